@@ -22,6 +22,8 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_md5.c \
+    nandroid_tar.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -30,6 +32,7 @@ LOCAL_SRC_FILES := \
     prop.c \
     adb_install.c \
     verifier.c \
+    verifier_sha.c \
     ../../system/vold/vdc.c \
     propsrvc/legacy_property_service.c
 
@@ -90,7 +93,7 @@ LOCAL_STATIC_LIBRARIES :=
 
 LOCAL_CFLAGS += -DUSE_EXT4 -DMINIVOLD
 LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include external/fsck_msdos
-LOCAL_C_INCLUDES += system/vold
+LOCAL_C_INCLUDES += system/vold external/zlib external/openssl/include
 
 LOCAL_STATIC_LIBRARIES += libext4_utils_static libz libsparse_static
 
@@ -127,7 +130,7 @@ LOCAL_CFLAGS += -DUSE_F2FS
 LOCAL_STATIC_LIBRARIES += libmake_f2fs libfsck_f2fs libfibmap_f2fs
 endif
 
-LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
+LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt libverifier_sha_hw
 
 LOCAL_STATIC_LIBRARIES += libminizip libminadbd libedify libbusybox libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
 LOCAL_LDFLAGS += -Wl,--no-fatal-warnings
@@ -191,11 +194,36 @@ LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
 LOCAL_SRC_FILES := killrecovery.sh
 include $(BUILD_PREBUILT)
 
+# The SHA block functions need the flags for their instructions, which the
+# rest of recovery must not be built with: verifier_sha.c only calls them
+# on a CPU that has them.  Toolchains before gcc 4.9 lack the intrinsics,
+# and the library is then empty.
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := verifier_test.c verifier.c
+LOCAL_SRC_FILES := verifier_sha_hw.c
+LOCAL_C_INCLUDES += external/openssl/include
+LOCAL_MODULE := libverifier_sha_hw
+LOCAL_MODULE_TAGS := optional
+
+ifeq ($(filter 4.6 4.7 4.8,$(TARGET_GCC_VERSION)),)
+ifeq ($(TARGET_ARCH),arm64)
+LOCAL_CFLAGS += -march=armv8-a+crypto
+endif
+ifeq ($(TARGET_ARCH),arm)
+LOCAL_CFLAGS += -march=armv8-a -mfpu=crypto-neon-fp-armv8 -mfloat-abi=softfp
+endif
+ifneq ($(filter x86 x86_64,$(TARGET_ARCH)),)
+LOCAL_CFLAGS += -msse4.1 -msha
+endif
+endif
 
-LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := verifier_test.c verifier.c verifier_sha.c
+
+LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include external/openssl/include
 
 LOCAL_MODULE := verifier_test
 
@@ -203,7 +231,23 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 LOCAL_MODULE_TAGS := tests
 
-LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+LOCAL_STATIC_LIBRARIES := libmincrypt libverifier_sha_hw libcrypto_static libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := verifier_bench.c verifier.c verifier_sha.c
+
+LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include external/openssl/include
+
+LOCAL_MODULE := verifier_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libmincrypt libverifier_sha_hw libcrypto_static libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
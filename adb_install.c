@@ -32,6 +32,8 @@
 #include "common.h"
 #include "recovery_ui.h"
 #include "adb_install.h"
+#include "extendedcommands.h"
+#include "verifier.h"
 #include "minadbd/adb.h"
 
 static void
@@ -125,6 +127,55 @@ else
     return NULL;
 }
 
+// With signature checking enabled, the package is hashed while minadbd
+// is still writing it to ADB_SIDELOAD_FILENAME, so only its last 64K are
+// left to verify once the transfer is done.  minadbd creates a new file
+// for every sideload session and only appends to it, so the hash is only
+// trusted for the first file seen; if it is replaced or shrinks, the
+// stream is thrown away and the package is verified from scratch.
+#define SIDELOAD_POLL_US (100 * 1000)
+
+struct sideload_hash_data {
+    pthread_mutex_t lock;
+    int transfer_done;
+    verify_stream* stream;
+    int fd;
+    int discarded;
+};
+
+static void *sideload_hash_thread(void* v) {
+    struct sideload_hash_data* data = (struct sideload_hash_data*)v;
+    off64_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&data->lock);
+        int done = data->transfer_done;
+        pthread_mutex_unlock(&data->lock);
+
+        struct stat st, fst;
+        if (data->fd < 0) {
+            data->fd = open(ADB_SIDELOAD_FILENAME, O_RDONLY | O_LARGEFILE | O_NOFOLLOW);
+        } else if (stat(ADB_SIDELOAD_FILENAME, &st) != 0 ||
+                   fstat(data->fd, &fst) != 0 ||
+                   fst.st_ino != st.st_ino || fst.st_dev != st.st_dev ||
+                   fst.st_size < seen) {
+            // another session replaced or restarted the file
+            data->discarded = 1;
+            break;
+        }
+        if (data->fd >= 0 && fstat(data->fd, &fst) == 0) {
+            seen = fst.st_size;
+            if (verify_stream_read(data->stream, data->fd, fst.st_size) != 0)
+                break;
+        }
+
+        if (done)
+            break;
+        usleep(SIDELOAD_POLL_US);
+    }
+    return NULL;
+}
+
 int
 apply_from_adb() {
     stop_adbd();
@@ -138,6 +189,9 @@ else
               "命令格式:\"adb sideload <文件名>\"...\n\n");
 
 
+    // so the hash thread can't pick up a package from an earlier sideload
+    remove(ADB_SIDELOAD_FILENAME);
+
     struct sideload_waiter_data data;
     if ((data.child = fork()) == 0) {
         execl("/sbin/recovery", "recovery", "adbd", NULL);
@@ -146,6 +200,23 @@ else
     
     pthread_t sideload_thread;
     pthread_create(&sideload_thread, NULL, &adb_sideload_thread, &data);
+
+    struct sideload_hash_data hash;
+    pthread_t hash_thread;
+    Certificate* loadedKeys = NULL;
+    int numKeys;
+    pthread_mutex_init(&hash.lock, NULL);
+    hash.transfer_done = 0;
+    hash.stream = NULL;
+    hash.fd = -1;
+    hash.discarded = 0;
+    if (signature_check_enabled &&
+        (loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys)) != NULL &&
+        (hash.stream = verify_stream_start(loadedKeys, numKeys)) != NULL &&
+        pthread_create(&hash_thread, NULL, &sideload_hash_thread, &hash) != 0) {
+        verify_stream_abort(hash.stream);
+        hash.stream = NULL;
+    }
     
     static const char* headers[] = {  "ADB Sideload",
                                 "",
@@ -171,7 +242,41 @@ if ( language== 0 )  {
     pthread_join(sideload_thread, NULL);
     ui_clear_key_queue();
 
-    struct stat st;
+    // adbd is gone, so the file is complete
+    if (hash.stream != NULL) {
+        pthread_mutex_lock(&hash.lock);
+        hash.transfer_done = 1;
+        pthread_mutex_unlock(&hash.lock);
+        pthread_join(hash_thread, NULL);
+    }
+
+    struct stat st, fst;
+    int verified = 0;
+    if (hash.stream != NULL) {
+        // only trust the hash if it covers the file that will be installed
+        if (!hash.discarded && hash.fd >= 0 && fstat(hash.fd, &fst) == 0 &&
+            stat(ADB_SIDELOAD_FILENAME, &st) == 0 &&
+            st.st_ino == fst.st_ino && st.st_dev == fst.st_dev &&
+            st.st_size == fst.st_size) {
+if ( language== 1 )
+            ui_print("Verifying update package...\n");
+else
+            ui_print("正在校验刷机包...\n");
+
+            int err = verify_stream_finish(hash.stream, hash.fd, fst.st_size);
+            LOGI("verify_stream_finish returned %d\n", err);
+            // if not, install_package() verifies it again and asks
+            verified = err == VERIFY_SUCCESS;
+        } else {
+            LOGI("sideload file was replaced; verifying it from scratch\n");
+            verify_stream_abort(hash.stream);
+        }
+    }
+    if (hash.fd >= 0)
+        close(hash.fd);
+    free(loadedKeys);
+    pthread_mutex_destroy(&hash.lock);
+
     if (stat(ADB_SIDELOAD_FILENAME, &st) != 0) {
         if (errno == ENOENT) {
 if ( language== 1 )
@@ -191,7 +296,8 @@ else
         return INSTALL_ERROR;
     }
 
-    int install_status = install_package(ADB_SIDELOAD_FILENAME);
+    int install_status = verified ? install_verified_package(ADB_SIDELOAD_FILENAME)
+                                  : install_package(ADB_SIDELOAD_FILENAME);
     ui_reset_progress();
 
     if (install_status != INSTALL_SUCCESS) {
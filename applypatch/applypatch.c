@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,7 @@
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
@@ -30,7 +32,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -58,7 +61,7 @@ int LoadFileContents(const char* filename, FileContents* file,
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 1);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -120,6 +123,31 @@ static int compare_size_indices(const void* a, const void* b) {
     }
 }
 
+enum PartitionType { MTD, EMMC };
+
+// Partitions are read and hashed in pieces of this size.
+#define PARTITION_READ_SIZE (1024*1024)
+
+// Read the next len bytes of the partition, which is at offset pos.
+static ssize_t ReadPartition(enum PartitionType type, MtdReadContext* ctx,
+                             int fd, unsigned char* data, size_t len,
+                             off64_t pos) {
+    if (type == MTD) {
+        return mtd_read_data(ctx, (char*)data, len);
+    }
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t r = pread64(fd, data + so_far, len - so_far, pos + so_far);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        so_far += r;
+    }
+    return so_far;
+}
+
 // Load the contents of an MTD or EMMC partition into the provided
 // FileContents.  filename should be a string of the form
 // "MTD:<partition_name>:<size_1>:<sha1_1>:<size_2>:<sha1_2>:..."  (or
@@ -135,9 +163,17 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
-enum PartitionType { MTD, EMMC };
+//
+// The partition is hashed once, in order of increasing size, and the
+// read stops at the first match.  With keep_data, file->data is left
+// holding just the matched bytes; otherwise only the size and sha1 are
+// filled in and nothing bigger than one read is allocated, which is all
+// applypatch_check needs.
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int keep_data) {
+    file->data = NULL;
+    file->size = 0;
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -150,6 +186,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     } else {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
+        free(copy);
         return -1;
     }
     const char* partition = strtok(NULL, ":");
@@ -164,21 +201,35 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     if (colons < 3 || colons%2 == 0) {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
+        free(copy);
+        return -1;
     }
 
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
     int* index = malloc(pairs * sizeof(int));
     size_t* size = malloc(pairs * sizeof(size_t));
-    char** sha1sum = malloc(pairs * sizeof(char*));
+    const char** sha1sum = malloc(pairs * sizeof(char*));
+    uint8_t* digest = malloc(pairs * SHA_DIGEST_SIZE);
+    unsigned char* buffer = NULL;
+    MtdReadContext* ctx = NULL;
+    int fd = -1;
+    int result = -1;
 
     for (i = 0; i < pairs; ++i) {
         const char* size_str = strtok(NULL, ":");
-        size[i] = strtol(size_str, NULL, 10);
+        const char* sha1_str = strtok(NULL, ":");
+        sha1sum[i] = sha1_str;
+        size[i] = size_str != NULL ? strtol(size_str, NULL, 10) : 0;
         if (size[i] == 0) {
             printf("LoadPartitionContents called with bad size (%s)\n", filename);
-            return -1;
+            goto done;
+        }
+        if (sha1_str == NULL ||
+            ParseSha1(sha1_str, digest + i * SHA_DIGEST_SIZE) != 0) {
+            printf("failed to parse sha1 %s in %s\n",
+                   sha1_str != NULL ? sha1_str : "", filename);
+            goto done;
         }
-        sha1sum[i] = strtok(NULL, ":");
         index[i] = i;
     }
 
@@ -187,9 +238,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     size_array = size;
     qsort(index, pairs, sizeof(int), compare_size_indices);
 
-    MtdReadContext* ctx = NULL;
-    FILE* dev = NULL;
-
     switch (type) {
         case MTD:
             if (!mtd_partitions_scanned) {
@@ -201,124 +249,130 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found (loading %s)\n",
                        partition, filename);
-                return -1;
+                goto done;
             }
 
             ctx = mtd_read_partition(mtd);
             if (ctx == NULL) {
                 printf("failed to initialize read of mtd partition \"%s\"\n",
                        partition);
-                return -1;
+                goto done;
             }
             break;
 
         case EMMC:
-            dev = fopen(partition, "rb");
-            if (dev == NULL) {
+            fd = open(partition, O_RDONLY | O_LARGEFILE);
+            if (fd < 0) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
-                return -1;
+                goto done;
             }
+            break;
+    }
+
+    if (!keep_data) {
+        buffer = malloc(PARTITION_READ_SIZE);
+        if (buffer == NULL) {
+            printf("failed to allocate partition read buffer\n");
+            goto done;
+        }
     }
 
     SHA_CTX sha_ctx;
     SHA_init(&sha_ctx);
-    uint8_t parsed_sha[SHA_DIGEST_SIZE];
-
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
-    char* p = (char*)file->data;
-    file->size = 0;                // # bytes read so far
+    uint8_t sha_so_far[SHA_DIGEST_SIZE];
+    int match = -1;
+
+    for (i = 0; i < pairs && match < 0; ) {
+        size_t target = size[index[i]];
+
+        // Only grow the buffer as far as the next size, so a match on a
+        // small size never costs the biggest one.
+        if (keep_data) {
+            unsigned char* grown = realloc(file->data, target);
+            if (grown == NULL) {
+                printf("failed to allocate %ld bytes for partition \"%s\"\n",
+                       (long)target, partition);
+                goto done;
+            }
+            file->data = grown;
+        }
 
-    for (i = 0; i < pairs; ++i) {
         // Read enough additional bytes to get us up to the next size
         // (again, we're trying the possibilities in order of increasing
         // size).
-        size_t next = size[index[i]] - file->size;
-        size_t read = 0;
-        if (next > 0) {
-            switch (type) {
-                case MTD:
-                    read = mtd_read_data(ctx, p, next);
-                    break;
-
-                case EMMC:
-                    read = fread(p, 1, next, dev);
-                    break;
-            }
-            if (next != read) {
+        while ((size_t)file->size < target) {
+            size_t next = target - file->size;
+            if (next > PARTITION_READ_SIZE) next = PARTITION_READ_SIZE;
+            unsigned char* p = keep_data ? file->data + file->size : buffer;
+            ssize_t read = ReadPartition(type, ctx, fd, p, next, file->size);
+            if (read < 0 || (size_t)read != next) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
-                       read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                       (int)read, next, partition);
+                goto done;
             }
             SHA_update(&sha_ctx, p, read);
             file->size += read;
         }
 
-        // Duplicate the SHA context and finalize the duplicate so we can
-        // check it against this pair's expected hash.
-        SHA_CTX temp_ctx;
-        memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        // Pairs may share a size; they are all checked against one hash.
+        int j = i;
+        while (j < pairs && size[index[j]] == target) ++j;
 
-        if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
-            printf("failed to parse sha1 %s in %s\n",
-                   sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+        if (j == pairs) {
+            // the biggest size, so the context isn't needed afterwards
+            memcpy(sha_so_far, SHA_final(&sha_ctx), SHA_DIGEST_SIZE);
+        } else {
+            SHA_CTX temp_ctx;
+            memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
+            memcpy(sha_so_far, SHA_final(&temp_ctx), SHA_DIGEST_SIZE);
         }
 
-        if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
-            // we have a match.  stop reading the partition; we'll return
-            // the data we've read so far.
-            printf("partition read matched size %d sha %s\n",
-                   size[index[i]], sha1sum[index[i]]);
-            break;
+        for (; i < j; ++i) {
+            if (memcmp(sha_so_far, digest + index[i] * SHA_DIGEST_SIZE,
+                       SHA_DIGEST_SIZE) == 0) {
+                match = index[i];
+                break;
+            }
         }
-
-        p += read;
-    }
-
-    switch (type) {
-        case MTD:
-            mtd_read_close(ctx);
-            break;
-
-        case EMMC:
-            fclose(dev);
-            break;
+        i = j;
     }
 
-
-    if (i == pairs) {
+    if (match < 0) {
         // Ran off the end of the list of (size,sha1) pairs without
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+        goto done;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
-    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
-        file->sha1[i] = sha_final[i];
-    }
+    // we have a match.  we stopped reading the partition there, so
+    // we hold just the data read so far.
+    printf("partition read matched size %d sha %s\n",
+           size[match], sha1sum[match]);
+    memcpy(file->sha1, sha_so_far, SHA_DIGEST_SIZE);
 
     // Fake some stat() info.
     file->st.st_mode = 0644;
     file->st.st_uid = 0;
     file->st.st_gid = 0;
+    result = 0;
 
+done:
+    if (ctx != NULL) mtd_read_close(ctx);
+    if (fd >= 0) close(fd);
+    if (result != 0) {
+        free(file->data);
+        file->data = NULL;
+    }
+    free(buffer);
     free(copy);
     free(index);
     free(size);
     free(sha1sum);
+    free(digest);
 
-    return 0;
+    return result;
 }
 
 
@@ -355,6 +409,233 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// eMMC partitions are written in windows of this size, with O_DIRECT
+// where the device allows it.  Offsets and lengths of direct I/O are
+// kept multiples of EMMC_ALIGN.
+#define EMMC_WINDOW_SIZE (4*1024*1024)
+#define EMMC_ALIGN 4096
+#define EMMC_WRITE_ATTEMPTS 10
+
+// Write [off, off+n) of data, copying it through the aligned buffer.  For
+// direct I/O a partial last block is read from the device first and
+// written back whole.
+static int WriteEmmcWindow(int fd, int direct, const char* partition,
+                           const unsigned char* data, off64_t off, size_t n,
+                           unsigned char* buffer) {
+    size_t whole = n & ~(size_t)(EMMC_ALIGN-1);
+    size_t total = n;
+    if (direct && whole < n) {
+        ssize_t r = pread64(fd, buffer + whole, EMMC_ALIGN, off + whole);
+        if (r < (ssize_t)(n - whole)) {
+            printf("failed to read last block of %s at %lld (%s)\n",
+                   partition, (long long)(off + whole), strerror(errno));
+            return -1;
+        }
+        total = whole + r;
+    }
+    memcpy(buffer, data + off, n);
+
+    size_t so_far = 0;
+    while (so_far < total) {
+        ssize_t written = pwrite64(fd, buffer + so_far, total - so_far,
+                                   off + so_far);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            printf("failed write writing to %s (%s)\n",
+                   partition, strerror(errno));
+            return -1;
+        }
+        so_far += written;
+    }
+    return 0;
+}
+
+// Without O_DIRECT, drop caches so our verification reads won't just be
+// reading the cache.
+static void DropCaches() {
+    sync();
+    int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (dc >= 0) {
+        write(dc, "3\n", 2);
+        close(dc);
+    }
+}
+
+// Read [off, off+n) back from the device and compare it with data.
+// Returns 1 if it matches.
+static int VerifyEmmcWindow(int fd, const unsigned char* data,
+                            off64_t off, size_t n, unsigned char* buffer) {
+    size_t aligned = (n + EMMC_ALIGN-1) & ~(size_t)(EMMC_ALIGN-1);
+    size_t so_far = 0;
+    while (so_far < n) {
+        ssize_t r = pread64(fd, buffer + so_far, aligned - so_far, off + so_far);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            printf("verify read error at %lld: %s\n",
+                   (long long)(off + so_far), r < 0 ? strerror(errno) : "eof");
+            return 0;
+        }
+        so_far += r;
+    }
+    return memcmp(buffer, data + off, n) == 0;
+}
+
+typedef struct {
+    int fd;
+    int direct;
+    const unsigned char* data;
+    size_t len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t written_cond;
+    size_t written;             // bytes written so far
+    int writing;
+    unsigned char* bad;         // per window, set if it didn't verify
+    unsigned char* buffer;
+} EmmcVerifier;
+
+// Syncs and reads back each run of windows as soon as it's written,
+// while the next ones are being written.
+static void* EmmcVerifyThread(void* cookie) {
+    EmmcVerifier* v = (EmmcVerifier*)cookie;
+    size_t pos = 0;
+
+    pthread_mutex_lock(&v->lock);
+    for (;;) {
+        while (v->written == pos && v->writing) {
+            pthread_cond_wait(&v->written_cond, &v->lock);
+        }
+        size_t end = v->written;
+        if (end == pos) break;
+        pthread_mutex_unlock(&v->lock);
+
+        fdatasync(v->fd);
+        if (!v->direct) DropCaches();
+        while (pos < end) {
+            size_t n = end - pos < EMMC_WINDOW_SIZE ? end - pos : EMMC_WINDOW_SIZE;
+            if (!VerifyEmmcWindow(v->fd, v->data, pos, n, v->buffer)) {
+                printf("verification failed in window at %lld\n", (long long)pos);
+                v->bad[pos / EMMC_WINDOW_SIZE] = 1;
+            }
+            pos += n;
+        }
+
+        pthread_mutex_lock(&v->lock);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+// Write data to the eMMC partition and read it back.  Windows are read
+// back on another thread while the following ones are written, and
+// only the windows that don't match are written again.
+static int WriteToEmmc(const char* partition, unsigned char* data, size_t len) {
+    int direct = 1;
+    int fd = open(partition, O_RDWR | O_DIRECT | O_LARGEFILE);
+    if (fd < 0 && errno == EINVAL) {
+        // not every device or filesystem does direct I/O
+        direct = 0;
+        fd = open(partition, O_RDWR | O_LARGEFILE);
+    }
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+
+    size_t windows = (len + EMMC_WINDOW_SIZE-1) / EMMC_WINDOW_SIZE;
+    EmmcVerifier v;
+    memset(&v, 0, sizeof(v));
+    v.fd = fd;
+    v.direct = direct;
+    v.data = data;
+    v.len = len;
+    v.writing = 1;
+    v.bad = calloc(windows > 0 ? windows : 1, 1);
+    unsigned char* buffer = memalign(EMMC_ALIGN, EMMC_WINDOW_SIZE);
+    v.buffer = memalign(EMMC_ALIGN, EMMC_WINDOW_SIZE);
+    if (v.bad == NULL || buffer == NULL || v.buffer == NULL) {
+        printf("failed to allocate buffers for writing %s\n", partition);
+        free(v.bad);
+        free(v.buffer);
+        free(buffer);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_init(&v.lock, NULL);
+    pthread_cond_init(&v.written_cond, NULL);
+
+    pthread_t verifier;
+    int threaded = pthread_create(&verifier, NULL, EmmcVerifyThread, &v) == 0;
+
+    printf("raw write %s (%ld bytes)\n", partition, (long)len);
+    int result = 0;
+    size_t pos;
+    for (pos = 0; pos < len; pos += EMMC_WINDOW_SIZE) {
+        size_t n = len - pos < EMMC_WINDOW_SIZE ? len - pos : EMMC_WINDOW_SIZE;
+        if (WriteEmmcWindow(fd, direct, partition, data, pos, n, buffer) != 0) {
+            result = -1;
+            break;
+        }
+        pthread_mutex_lock(&v.lock);
+        v.written = pos + n;
+        pthread_cond_signal(&v.written_cond);
+        pthread_mutex_unlock(&v.lock);
+    }
+
+    pthread_mutex_lock(&v.lock);
+    v.writing = 0;
+    pthread_cond_signal(&v.written_cond);
+    pthread_mutex_unlock(&v.lock);
+    if (threaded) {
+        pthread_join(verifier, NULL);
+    } else if (result == 0) {
+        EmmcVerifyThread(&v);
+    }
+
+    // Write the windows that didn't verify again, on their own.
+    size_t w;
+    int retried = 0;
+    for (w = 0; result == 0 && w < windows; ++w) {
+        if (!v.bad[w]) continue;
+        off64_t off = (off64_t)w * EMMC_WINDOW_SIZE;
+        size_t n = len - off < EMMC_WINDOW_SIZE ? len - off : EMMC_WINDOW_SIZE;
+        int attempt;
+        for (attempt = 1; attempt < EMMC_WRITE_ATTEMPTS; ++attempt) {
+            printf("raw write %s attempt %d at %lld\n",
+                   partition, attempt+1, (long long)off);
+            ++retried;
+            if (WriteEmmcWindow(fd, direct, partition, data, off, n, buffer) != 0) {
+                result = -1;
+                break;
+            }
+            fdatasync(fd);
+            if (!direct) DropCaches();
+            if (VerifyEmmcWindow(fd, data, off, n, v.buffer)) break;
+            sleep(2);
+        }
+        if (result == 0 && attempt == EMMC_WRITE_ATTEMPTS) {
+            printf("failed to verify after all attempts\n");
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        printf("verification read succeeded (%d window rewrite%s)\n",
+               retried, retried == 1 ? "" : "s");
+    }
+
+    pthread_cond_destroy(&v.written_cond);
+    pthread_mutex_destroy(&v.lock);
+    free(v.bad);
+    free(v.buffer);
+    free(buffer);
+
+    if (close(fd) != 0 && result == 0) {
+        printf("error closing %s (%s)\n", partition, strerror(errno));
+        result = -1;
+    }
+    return result;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -421,111 +702,10 @@ int WriteToPartition(unsigned char* data, size_t len,
             break;
 
         case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-
-                sleep(2);
-            }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
+            if (WriteToEmmc(partition, data, len) != 0) {
                 return -1;
             }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
-            }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
-        }
     }
 
     free(copy);
@@ -590,8 +770,14 @@ int applypatch_check(const char* filename,
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
-    // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    // check them twice.)  Partitions are only hashed, not kept.
+    int filestate;
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        filestate = LoadPartitionContents(filename, &file, 0);
+    } else {
+        filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    }
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
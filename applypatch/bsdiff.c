@@ -50,6 +50,8 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -156,6 +158,158 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/*
+ * Linear time suffix sorting (SA-IS, Nong, Zhang & Chan 2009) with 32-bit
+ * indices, for inputs shorter than 2GB.  The string is followed by a
+ * virtual sentinel smaller than every character, so the last character is
+ * always L-type and position n is the last LMS position.  Characters are
+ * bytes at the top level and int32_t names in the recursion (cs is the
+ * character size).  Sorts the n suffixes of s into SA[0..n-1].
+ */
+#define SAIS_CHR(i) (cs==1 ? (int32_t)((const u_char *)s)[i] : ((const int32_t *)s)[i])
+#define SAIS_TGET(i) ((t[(i)>>3]>>((i)&7))&1)		/* 1 for S-type */
+#define SAIS_TSET(i,b) (t[(i)>>3]=(b) ? t[(i)>>3]|(1<<((i)&7)) : t[(i)>>3]&~(1<<((i)&7)))
+#define SAIS_LMS(i) ((i)>0 && SAIS_TGET(i) && !SAIS_TGET((i)-1))
+
+static void sais_buckets(const void *s,int cs,int32_t n,int32_t K,
+		int32_t *bkt,int end)
+{
+	int32_t i,sum=0;
+
+	for(i=0;i<K;i++) bkt[i]=0;
+	for(i=0;i<n;i++) bkt[SAIS_CHR(i)]++;
+	for(i=0;i<K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
+
+static void sais_induce(const void *s,int cs,const u_char *t,int32_t *SA,
+		int32_t n,int32_t K,int32_t *bkt)
+{
+	int32_t i,j;
+
+	/* L-type suffixes, left to right; n-1 follows the sentinel */
+	sais_buckets(s,cs,n,K,bkt,0);
+	SA[bkt[SAIS_CHR(n-1)]++]=n-1;
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(SA[i]>0 && !SAIS_TGET(j)) SA[bkt[SAIS_CHR(j)]++]=j;
+	};
+
+	/* S-type suffixes, right to left */
+	sais_buckets(s,cs,n,K,bkt,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(SA[i]>0 && SAIS_TGET(j)) SA[--bkt[SAIS_CHR(j)]]=j;
+	};
+}
+
+static int sais(const void *s,int cs,int32_t *SA,int32_t n,int32_t K)
+{
+	u_char *t;
+	int32_t *bkt,*s1,*SA1;
+	int32_t i,j,n1,name,prev,pos,d;
+	int diff;
+
+	if(n==0) return 0;
+	if(((t=calloc(n/8+1,1))==NULL) ||
+		((bkt=malloc(K*sizeof(int32_t)))==NULL)) {
+		free(t);
+		return -1;
+	};
+
+	/* Classify the suffixes */
+	SAIS_TSET(n-1,0);
+	for(i=n-2;i>=0;i--)
+		SAIS_TSET(i,SAIS_CHR(i)<SAIS_CHR(i+1) ||
+			(SAIS_CHR(i)==SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+	/* Sort the LMS substrings */
+	sais_buckets(s,cs,n,K,bkt,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(SAIS_LMS(i)) SA[--bkt[SAIS_CHR(i)]]=i;
+	sais_induce(s,cs,t,SA,n,K,bkt);
+
+	/* Move the sorted LMS substrings to the front and name them */
+	for(i=0,n1=0;i<n;i++) if(SAIS_LMS(SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;;d++) {
+			/* only one substring reaches the sentinel */
+			if(prev==-1 || pos+d==n || prev+d==n ||
+				SAIS_CHR(pos+d)!=SAIS_CHR(prev+d) ||
+				SAIS_TGET(pos+d)!=SAIS_TGET(prev+d)) {
+				diff=1;
+				break;
+			};
+			if(d>0 && (SAIS_LMS(pos+d) || SAIS_LMS(prev+d))) break;
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	/* Sort the reduced string, recursing if the names aren't unique */
+	s1=SA+n-n1;SA1=SA;
+	if(name<n1) {
+		if(sais(s1,4,SA1,n1,name)!=0) {
+			free(t);free(bkt);
+			return -1;
+		};
+	} else {
+		for(i=0;i<n1;i++) SA1[s1[i]]=i;
+	};
+
+	/* Induce the full order from the sorted LMS suffixes */
+	for(i=1,j=0;i<n;i++) if(SAIS_LMS(i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA1[i]=s1[SA1[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	sais_buckets(s,cs,n,K,bkt,1);
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=-1;
+		SA[--bkt[SAIS_CHR(j)]]=j;
+	};
+	sais_induce(s,cs,t,SA,n,K,bkt);
+
+	free(t);free(bkt);
+	return 0;
+}
+
+/*
+ * Sorted suffixes of 'old', with the empty suffix first, as qsufsort()
+ * leaves them in I.  32-bit when old is small enough, which is nearly
+ * always; otherwise the qsufsort() array.
+ */
+struct bsdiff_index {
+	int32_t *I32;
+	off_t *I;
+};
+
+#define SA_AT(ix,i) ((ix)->I32!=NULL ? (off_t)(ix)->I32[i] : (ix)->I[i])
+
+static struct bsdiff_index *build_index(u_char *old,off_t oldsize)
+{
+	struct bsdiff_index *ix;
+	off_t *V;
+
+	if((ix=calloc(1,sizeof(*ix)))==NULL) err(1,NULL);
+	if(oldsize<INT32_MAX) {
+		if((ix->I32=malloc((oldsize+1)*sizeof(int32_t)))==NULL)
+			err(1,NULL);
+		ix->I32[0]=oldsize;
+		if(sais(old,1,ix->I32+1,oldsize,256)!=0) err(1,NULL);
+	} else {
+		if(((ix->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+			((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
+		qsufsort(ix->I,V,old,oldsize);
+		free(V);
+	};
+	return ix;
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,30 +320,172 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const struct bsdiff_index *ix,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,i;
 
-	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
-
-		if(x>y) {
-			*pos=I[st];
-			return x;
+	while(en-st>=2) {
+		x=st+(en-st)/2;
+		i=SA_AT(ix,x);
+		if(memcmp(old+i,new,MIN(oldsize-i,newsize))<0) {
+			st=x;
 		} else {
-			*pos=I[en];
-			return y;
-		}
+			en=x;
+		};
 	};
 
-	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	ist=SA_AT(ix,st);ien=SA_AT(ix,en);
+	x=matchlen(old+ist,oldsize-ist,new,newsize);
+	y=matchlen(old+ien,oldsize-ien,new,newsize);
+
+	if(x>y) {
+		*pos=ist;
+		return x;
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		*pos=ien;
+		return y;
+	}
+}
+
+/*
+ * The scan in bsdiff() looks for the longest match at one position of
+ * 'new' after another until it finds one worth using, then skips past
+ * it.  Those searches only depend on the position, so the positions
+ * ahead of the scan are searched in batches on a few threads, and the
+ * scan takes the results in order; its output is the same.  A long match
+ * usually ends the run, so a worker that finds one stops the batch
+ * there rather than searching the rest of the match over and over.
+ */
+#define SEARCH_MAX_THREADS 8
+#define SEARCH_BATCH 1024
+#define SEARCH_LONG_MATCH 64
+
+struct search_pool {
+	const struct bsdiff_index *ix;
+	u_char *old,*new;
+	off_t oldsize,newsize;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start,finished;
+	int generation,busy,quit;
+
+	off_t base,count;		/* the batch: [base, base+count) */
+	off_t next,cutoff;
+	off_t len[SEARCH_BATCH],pos[SEARCH_BATCH];	/* len -1: not searched */
+};
+
+static void search_batch(struct search_pool *sp)
+{
+	off_t k,len;
+
+	for(;;) {
+		pthread_mutex_lock(&sp->lock);
+		k=sp->next++;
+		if(k>=sp->count || k>sp->cutoff) {
+			pthread_mutex_unlock(&sp->lock);
+			return;
+		};
+		pthread_mutex_unlock(&sp->lock);
+
+		len=search(sp->ix,sp->old,sp->oldsize,sp->new+sp->base+k,
+			sp->newsize-sp->base-k,0,sp->oldsize,&sp->pos[k]);
+		sp->len[k]=len;
+
+		if(len>SEARCH_LONG_MATCH) {
+			pthread_mutex_lock(&sp->lock);
+			if(k<sp->cutoff) sp->cutoff=k;
+			pthread_mutex_unlock(&sp->lock);
+		};
+	};
+}
+
+static void *search_thread(void *cookie)
+{
+	struct search_pool *sp=cookie;
+	int seen=0;
+
+	pthread_mutex_lock(&sp->lock);
+	for(;;) {
+		while(!sp->quit && sp->generation==seen)
+			pthread_cond_wait(&sp->start,&sp->lock);
+		if(sp->quit) break;
+		seen=sp->generation;
+		pthread_mutex_unlock(&sp->lock);
+
+		search_batch(sp);
+
+		pthread_mutex_lock(&sp->lock);
+		if(--sp->busy==0) pthread_cond_signal(&sp->finished);
+	};
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
+
+/* The longest match for new+scan, from the current batch if it has it. */
+static off_t search_at(struct search_pool *sp,int threads,off_t scan,
+		off_t *pos)
+{
+	off_t k,i;
+
+	if(threads==0)
+		return search(sp->ix,sp->old,sp->oldsize,sp->new+scan,
+			sp->newsize-scan,0,sp->oldsize,pos);
+
+	k=scan-sp->base;
+	if(k<0 || k>=sp->count || sp->len[k]<0) {
+		pthread_mutex_lock(&sp->lock);
+		sp->base=scan;
+		sp->count=MIN(SEARCH_BATCH,sp->newsize-scan);
+		for(i=0;i<sp->count;i++) sp->len[i]=-1;
+		sp->next=0;
+		sp->cutoff=sp->count;
+		sp->busy=threads;
+		sp->generation++;
+		pthread_cond_broadcast(&sp->start);
+		pthread_mutex_unlock(&sp->lock);
+
+		search_batch(sp);
+
+		pthread_mutex_lock(&sp->lock);
+		while(sp->busy>0) pthread_cond_wait(&sp->finished,&sp->lock);
+		pthread_mutex_unlock(&sp->lock);
+		k=0;
 	};
+
+	*pos=sp->pos[k];
+	return sp->len[k];
+}
+
+static int search_start(struct search_pool *sp,pthread_t *workers)
+{
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	int wanted=cpus<1 ? 0 : cpus>SEARCH_MAX_THREADS ?
+		SEARCH_MAX_THREADS-1 : (int)cpus-1;
+	int i;
+
+	sp->count=0;
+	sp->generation=0;sp->busy=0;sp->quit=0;
+	pthread_mutex_init(&sp->lock,NULL);
+	pthread_cond_init(&sp->start,NULL);
+	pthread_cond_init(&sp->finished,NULL);
+	for(i=0;i<wanted;i++)
+		if(pthread_create(&workers[i],NULL,search_thread,sp)!=0) break;
+	return i;
+}
+
+static void search_stop(struct search_pool *sp,pthread_t *workers,int threads)
+{
+	int i;
+
+	pthread_mutex_lock(&sp->lock);
+	sp->quit=1;
+	pthread_cond_broadcast(&sp->start);
+	pthread_mutex_unlock(&sp->lock);
+	for(i=0;i<threads;i++) pthread_join(workers[i],NULL);
+	pthread_cond_destroy(&sp->finished);
+	pthread_cond_destroy(&sp->start);
+	pthread_mutex_destroy(&sp->lock);
 }
 
 static void offtout(off_t x,u_char *buf)
@@ -216,16 +512,21 @@ static void offtout(off_t x,u_char *buf)
 //      data from files.  old and new are owned by the caller; we
 //      don't free them at the end.
 //
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
+//    - the suffix index is owned by the caller, who passes a
+//      pointer to it, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffix sorting step the first time.
+//
+//    - suffixes are sorted with SA-IS into 32-bit indices unless old
+//      is 2GB or more, and the match search runs on several threads;
+//      the patch is the same as before.
 //
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+int bsdiff(u_char* old, off_t oldsize, struct bsdiff_index** IP,
+           u_char* new, off_t newsize, const char* patch_filename)
 {
-	int fd;
-	off_t *I;
+	struct search_pool *sp;
+	pthread_t workers[SEARCH_MAX_THREADS];
+	int threads;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
@@ -241,13 +542,14 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = build_index(old, oldsize);
         }
-        I = *IP;
+
+	if((sp=malloc(sizeof(*sp)))==NULL) err(1,NULL);
+	sp->ix=*IP;
+	sp->old=old;sp->oldsize=oldsize;
+	sp->new=new;sp->newsize=newsize;
+	threads=search_start(sp,workers);
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
@@ -284,8 +586,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
-					0,oldsize,&pos);
+			len=search_at(sp,threads,scan,&pos);
 
 			for(;scsc<scan+len;scsc++)
 			if((scsc+lastoffset<oldsize) &&
@@ -363,6 +664,8 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
 	if (bz2err != BZ_OK)
 		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	search_stop(sp,workers,threads);
+	free(sp);
 
 	/* Compute size of compressed ctrl data */
 	if ((len = ftello(pf)) == -1)
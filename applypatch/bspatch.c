@@ -21,6 +21,7 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -97,32 +98,13 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
-
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
-    }
+// Output is produced in windows of this size, so that patching a large
+// file needs memory for the source but not for the whole target.
+#define BSDIFF_WINDOW_SIZE (1024*1024)
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
-    }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
-    }
-    free(new_data);
-
-    return 0;
-}
-
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset,
+                            ssize_t* ctrl_len, ssize_t* data_len,
+                            ssize_t* new_size) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -135,23 +117,54 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
 
+    if (patch_offset < 0 || patch->size - patch_offset < 32) {
+        printf("corrupt bsdiff patch file header (too short)\n");
+        return 1;
+    }
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
     if (memcmp(header, "BSDIFF40", 8) != 0) {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0 ||
+        *ctrl_len > patch->size - patch_offset - 32 ||
+        *data_len > patch->size - patch_offset - 32 - *ctrl_len) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
+    return 0;
+}
 
+// Hand a full window (or the final partial one) to the sink.  With no
+// sink the window is the whole output and nothing needs to be done.
+static int FlushWindow(unsigned char* window, ssize_t* used,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (sink == NULL || *used == 0) return 0;
+    if (sink(window, *used, token) < *used) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        return 1;
+    }
+    if (ctx) {
+        SHA_update(ctx, window, *used);
+    }
+    *used = 0;
+    return 0;
+}
+
+// Decode the patch into the window, flushing it to the sink whenever it
+// fills up.  window_size is new_size when there is no sink.
+static int RunBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                          const Value* patch, ssize_t patch_offset,
+                          ssize_t ctrl_len, ssize_t data_len, ssize_t new_size,
+                          unsigned char* window, ssize_t window_size,
+                          SinkFn sink, void* token, SHA_CTX* ctx) {
     int bzerr;
+    int result = 1;
 
     bz_stream cstream;
     cstream.next_in = patch->data + patch_offset + 32;
@@ -183,70 +196,136 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
-    }
-
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    ssize_t used = 0;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] > new_size ||
+            newpos + ctrl[0] + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it, a window at a time
+        off_t left = ctrl[0];
+        while (left > 0) {
+            ssize_t n = window_size - used;
+            if (n > left) n = left;
+            unsigned char* out = window + used;
+            if (FillBuffer(out, n, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
             }
-        }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+            // only the part of [oldpos, oldpos+n) inside the old file
+            off_t lo = oldpos < 0 ? -oldpos : 0;
+            off_t hi = old_size - oldpos < n ? old_size - oldpos : n;
+            off_t i;
+            for (i = lo; i < hi; ++i) {
+                out[i] += old_data[oldpos+i];
+            }
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
+            used += n;
+            newpos += n;
+            oldpos += n;
+            left -= n;
+            if (used == window_size &&
+                FlushWindow(window, &used, sink, token, ctx) != 0) {
+                goto done;
+            }
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        left = ctrl[1];
+        while (left > 0) {
+            ssize_t n = window_size - used;
+            if (n > left) n = left;
+            if (FillBuffer(window + used, n, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            used += n;
+            newpos += n;
+            left -= n;
+            if (used == window_size &&
+                FlushWindow(window, &used, sink, token, ctx) != 0) {
+                goto done;
+            }
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
+    result = FlushWindow(window, &used, sink, token, ctx);
+
+done:
     BZ2_bzDecompressEnd(&cstream);
     BZ2_bzDecompressEnd(&dstream);
     BZ2_bzDecompressEnd(&estream);
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    ssize_t ctrl_len, data_len, new_size;
+    if (ReadBSDiffHeader(patch, patch_offset,
+                         &ctrl_len, &data_len, &new_size) != 0) {
+        return 1;
+    }
+
+    ssize_t window_size = new_size < BSDIFF_WINDOW_SIZE ? new_size : BSDIFF_WINDOW_SIZE;
+    if (window_size == 0) return 0;
+    unsigned char* window = malloc(window_size);
+    if (window == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)window_size);
+        return 1;
+    }
+
+    int result = RunBSDiffPatch(old_data, old_size, patch, patch_offset,
+                                ctrl_len, data_len, new_size,
+                                window, window_size, sink, token, ctx);
+    free(window);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    ssize_t ctrl_len, data_len;
+    if (ReadBSDiffHeader(patch, patch_offset,
+                         &ctrl_len, &data_len, new_size) != 0) {
+        return 1;
+    }
+
+    // malloc(0) may return NULL, which callers would take for failure
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    if (RunBSDiffPatch(old_data, old_size, patch, patch_offset,
+                       ctrl_len, data_len, *new_size,
+                       *new_data, *new_size, NULL, NULL, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
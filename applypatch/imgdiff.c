@@ -143,7 +143,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  struct bsdiff_index* I;  // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -179,8 +179,8 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+int bsdiff(u_char* old, off_t oldsize, struct bsdiff_index** IP,
+           u_char* new, off_t newsize, const char* patch_filename);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -18,22 +18,235 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "zlib.h"
+#include "cutils/properties.h"
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 #include "imgdiff.h"
 #include "utils.h"
 
+// Deflate chunks are rebuilt on up to this many threads.
+#define IMGPATCH_MAX_WORKERS 4
+
+// Memory the chunks being rebuilt (and their output waiting to be
+// written) may use at once, unless ro.cwm.imgpatch_memory_mb says
+// otherwise.  A chunk bigger than this is still rebuilt, on its own.
+#define IMGPATCH_DEFAULT_BUDGET_MB 64
+
+typedef struct {
+    int index;                  // chunk number in the patch
+    const char* header;         // the 60 byte deflate chunk header
+    size_t bonus_size;
+    size_t cost;                // bytes reserved from the budget
+
+    int done;
+    int status;
+    unsigned char* output;      // deflated target data
+    ssize_t output_size;
+} DeflateJob;
+
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    DeflateJob* jobs;
+    int num_jobs;
+    int next_job;               // next job a worker may claim
+    size_t in_use;
+    size_t budget;
+    int abort;
+} DeflatePool;
+
+// Rebuild one deflate chunk: inflate the source, apply the bsdiff patch
+// to it and deflate the result with the original settings.
+static int ReconstructDeflateChunk(const DeflatePool* pool, DeflateJob* job) {
+    const char* deflate_header = job->header;
+    size_t src_start = Read8((void*)deflate_header);
+    size_t src_len = Read8((void*)(deflate_header+8));
+    size_t patch_offset = Read8((void*)(deflate_header+16));
+    size_t expanded_len = Read8((void*)(deflate_header+24));
+    int level = Read4((void*)(deflate_header+40));
+    int method = Read4((void*)(deflate_header+44));
+    int windowBits = Read4((void*)(deflate_header+48));
+    int memLevel = Read4((void*)(deflate_header+52));
+    int strategy = Read4((void*)(deflate_header+56));
+    int i = job->index;
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = job->bonus_size;
+
+    unsigned char* expanded_source = malloc(expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = (unsigned char*)(pool->old_data + src_start);
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d (chunk %d)\n", ret, i);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %d bytes (chunk %d)\n",
+               strm.avail_out-bonus_size, i);
+        free(expanded_source);
+        return -1;
+    }
+
+    if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size),
+               pool->bonus_data->data, bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                              pool->patch, patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data, in one go since the output has to
+    // wait for the chunks before it anyway.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d (chunk %d)\n", ret, i);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    uLong bound = deflateBound(&strm, uncompressed_target_size);
+    job->output = malloc(bound);
+    if (job->output == NULL) {
+        printf("failed to allocate %ld bytes for deflated chunk %d\n",
+               (long)bound, i);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = job->output;
+    ret = deflate(&strm, Z_FINISH);
+    job->output_size = bound - strm.avail_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+    if (ret != Z_STREAM_END) {
+        printf("target deflation returned %d (chunk %d)\n", ret, i);
+        return -1;
+    }
+    return 0;
+}
+
+static void* DeflateWorker(void* cookie) {
+    DeflatePool* pool = (DeflatePool*)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        // Jobs are claimed in patch order, and a job only waits for
+        // budget while others are in use, so the one the writer needs
+        // next always gets to run.
+        while (!pool->abort && pool->next_job < pool->num_jobs &&
+               pool->in_use > 0 &&
+               pool->in_use + pool->jobs[pool->next_job].cost > pool->budget) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->abort || pool->next_job >= pool->num_jobs) break;
+
+        DeflateJob* job = &pool->jobs[pool->next_job++];
+        pool->in_use += job->cost;
+        pthread_mutex_unlock(&pool->lock);
+
+        int status = ReconstructDeflateChunk(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        // only the output is kept until it's written
+        size_t kept = status == 0 ? job->output_size : 0;
+        if (kept < job->cost) {
+            pool->in_use -= job->cost - kept;
+            job->cost = kept;
+        }
+        job->status = status;
+        job->done = 1;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static size_t ImagePatchMemoryBudget() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.imgpatch_memory_mb", value, "");
+    long mb = atol(value);
+    if (mb <= 0) mb = IMGPATCH_DEFAULT_BUDGET_MB;
+    return (size_t)mb * 1024 * 1024;
+}
+
+static int online_cpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > IMGPATCH_MAX_WORKERS)
+        return IMGPATCH_MAX_WORKERS;
+    return (int)cpus;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
  * file, and update the SHA context with the output data as well.
  * Return 0 on success.
+ *
+ * Deflate chunks are rebuilt ahead of time on a few threads, as far as
+ * the memory budget allows; everything is written out in chunk order.
  */
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
@@ -55,49 +268,55 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+
+    // First pass: check the chunk records and collect the deflate chunks,
+    // so they can be rebuilt while earlier chunks are being written.
+    DeflatePool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.old_data = old_data;
+    pool.patch = patch;
+    pool.bonus_data = bonus_data;
+    pool.budget = ImagePatchMemoryBudget();
+    pool.jobs = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(DeflateJob));
+    if (pool.jobs == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
+            free(pool.jobs);
             return -1;
         }
         int type = Read4(patch->data + pos);
         pos += 4;
 
         if (type == CHUNK_NORMAL) {
-            char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
+                free(pool.jobs);
                 return -1;
             }
-
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
+                free(pool.jobs);
                 return -1;
             }
-
             ssize_t data_len = Read4(raw_header);
-
-            if (pos + data_len > patch->size) {
+            if (data_len < 0 || pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
+                free(pool.jobs);
                 return -1;
             }
             pos += data_len;
@@ -107,126 +326,129 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
+                free(pool.jobs);
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
+            DeflateJob* job = &pool.jobs[pool.num_jobs++];
+            memset(job, 0, sizeof(*job));
+            job->index = i;
+            job->header = deflate_header;
+            job->bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+
+            // expanded source, patched target (from the bsdiff header
+            // when it's there) and the deflated target
             size_t patch_offset = Read8(deflate_header+16);
             size_t expanded_len = Read8(deflate_header+24);
             size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
+            size_t patched_len = expanded_len;
+            if (patch_offset + 32 <= (size_t)patch->size) {
+                long long n = Read8(patch->data + patch_offset + 24);
+                if (n >= 0) patched_len = n;
             }
+            job->cost = expanded_len + patched_len + target_len;
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, type);
+            free(pool.jobs);
+            return -1;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
+    pthread_t workers[IMGPATCH_MAX_WORKERS];
+    int num_workers = 0;
+    if (pool.num_jobs > 0) {
+        int wanted = online_cpus();
+        if (wanted > pool.num_jobs) wanted = pool.num_jobs;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.changed, NULL);
+        for (; num_workers < wanted; ++num_workers) {
+            if (pthread_create(&workers[num_workers], NULL,
+                               DeflateWorker, &pool) != 0) {
+                break;
             }
+        }
+    }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+    // Second pass: write every chunk out in order.
+    int result = 0;
+    int job_index = 0;
+    pos = 12;
+    for (i = 0; i < num_chunks && result == 0; ++i) {
+        int type = Read4(patch->data + pos);
+        pos += 4;
+
+        if (type == CHUNK_NORMAL) {
+            char* normal_header = patch->data + pos;
+            pos += 24;
+
+            size_t src_start = Read8(normal_header);
+            size_t src_len = Read8(normal_header+8);
+            size_t patch_offset = Read8(normal_header+16);
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
+            ApplyBSDiffPatch(old_data + src_start, src_len,
+                             patch, patch_offset, sink, token, ctx);
+        } else if (type == CHUNK_RAW) {
+            ssize_t data_len = Read4(patch->data + pos);
+            pos += 4;
+
+            SHA_update(ctx, patch->data + pos, data_len);
+            if (sink((unsigned char*)patch->data + pos,
+                     data_len, token) != data_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                result = -1;
             }
+            pos += data_len;
+        } else {
+            pos += 60;
+            DeflateJob* job = &pool.jobs[job_index++];
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+            if (num_workers == 0) {
+                job->status = ReconstructDeflateChunk(&pool, job);
+            } else {
+                pthread_mutex_lock(&pool.lock);
+                while (!job->done) {
+                    pthread_cond_wait(&pool.changed, &pool.lock);
+                }
+                pthread_mutex_unlock(&pool.lock);
             }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            if (job->status != 0) {
+                result = -1;
+            } else if (sink(job->output, job->output_size, token) != job->output_size) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)job->output_size);
+                result = -1;
+            } else {
+                SHA_update(ctx, job->output, job->output_size);
             }
+            free(job->output);
+            job->output = NULL;
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
+            if (num_workers > 0) {
+                pthread_mutex_lock(&pool.lock);
+                pool.in_use -= job->cost;
+                job->cost = 0;
+                pthread_cond_broadcast(&pool.changed);
+                pthread_mutex_unlock(&pool.lock);
+            }
+        }
+    }
 
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+    if (pool.num_jobs > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pool.abort = 1;
+        pthread_cond_broadcast(&pool.changed);
+        pthread_mutex_unlock(&pool.lock);
+        while (num_workers > 0) {
+            pthread_join(workers[--num_workers], NULL);
+        }
+        pthread_cond_destroy(&pool.changed);
+        pthread_mutex_destroy(&pool.lock);
+        for (i = 0; i < pool.num_jobs; ++i) {
+            free(pool.jobs[i].output);
         }
     }
+    free(pool.jobs);
 
-    return 0;
+    return result;
 }
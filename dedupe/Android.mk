@@ -8,21 +8,22 @@ LOCAL_SRC_FILES := dedupe.c driver.c \
 
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE := dedupe
-LOCAL_STATIC_LIBRARIES := libcrypto_static libselinux
-LOCAL_C_INCLUDES += external/openssl/include external/libselinux/include
+LOCAL_STATIC_LIBRARIES := libcrypto_static libselinux libz
+LOCAL_C_INCLUDES += external/openssl/include external/libselinux/include external/zlib
+LOCAL_LDLIBS += -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := dedupe.c
-LOCAL_STATIC_LIBRARIES := libcrypto_static libcutils libc libselinux
+LOCAL_STATIC_LIBRARIES := libcrypto_static libcutils libc libselinux libz
 LOCAL_MODULE := libdedupe
 LOCAL_MODULE_TAGS := eng
-LOCAL_C_INCLUDES := external/openssl/include external/libselinux/include
+LOCAL_C_INCLUDES := external/openssl/include external/libselinux/include external/zlib
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := driver.c
-LOCAL_STATIC_LIBRARIES := libdedupe libcrypto_static libcutils libc libselinux
+LOCAL_STATIC_LIBRARIES := libdedupe libcrypto_static libcutils libc libselinux libz
 LOCAL_MODULE := utility_dedupe
 LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE_STEM := dedupe
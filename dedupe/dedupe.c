@@ -3,167 +3,1241 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
-#include <assert.h>
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <paths.h>
+#include <pthread.h>
 #include <sys/wait.h>
 
+#include <sys/mman.h>
+
 #include <selinux/selinux.h>
+#include <zlib.h>
+
+#include "dedupe_manifest.h"
+
+#define DEDUPE_VERSION 3
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define MAX_JOBS 32
+#define CACHE_BUCKETS 65536
+
+// Files larger than the maximum chunk size are split into content-defined
+// chunks (manifest v3), see -s
+#define CHUNK_MIN_SIZE (256 * 1024)
+#define CHUNK_AVG_SIZE (1024 * 1024)
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+// key of a chunked file entry, its chunks follow on "c" lines
+#define CHUNKED_KEY "-"
+
+// With -z, blobs are stored as gzip in <key>.gz, unless the first
+// COMPRESS_SAMPLE_SIZE bytes (or the whole blob) shrink by less than 10%.
+#define COMPRESSED_SUFFIX ".gz"
+#define COMPRESS_SAMPLE_SIZE (256 * 1024)
+
+// Copy the rest of srcfd to dstfd in the kernel when the filesystems allow
+// it: copy_file_range, then sendfile, then plain reads and writes. Both fds
+// advance, so each method picks up where the previous one gave up.
+static int copy_fd(int srcfd, int dstfd) {
+    ssize_t n;
+#ifdef __NR_copy_file_range
+    while ((n = syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, 1024 * 1024 * 1024, 0)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+    }
+    if (n == 0)
+        return 0;
+#endif
+    while ((n = sendfile(dstfd, srcfd, NULL, 1024 * 1024 * 1024)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+    }
+    if (n == 0)
+        return 0;
+
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    int ret = 0;
+    if (buf == NULL)
+        return 5;
+    while (ret == 0 && (n = read(srcfd, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = 5;
+        } else if (write(dstfd, buf, n) != n) {
+            ret = 5;
+        }
+    }
+    free(buf);
+    return ret;
+}
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
+// append the contents of src to dstfd
+static int append_file(const char *src, int dstfd) {
+    int srcfd, ret;
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (src == NULL)
-        return 1;
-    if (dst == NULL)
-        return 2;
+    srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+
+    ret = copy_fd(srcfd, dstfd);
+    close(srcfd);
+    return ret;
+}
+
+// append the decompressed contents of the gzip file src to dstfd
+static int inflate_file(const char *src, int dstfd) {
+    unsigned char *in, *out;
+    int srcfd, ret = 0, zret = Z_OK;
+    ssize_t bytes_read;
+    z_stream strm;
 
     srcfd = open(src, O_RDONLY);
     if (srcfd < 0)
         return 3;
 
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (dstfd < 0) {
+    memset(&strm, 0, sizeof(strm));
+    in = malloc(COPY_BUFFER_SIZE);
+    out = malloc(COPY_BUFFER_SIZE);
+    if (in == NULL || out == NULL || inflateInit2(&strm, 15 + 16) != Z_OK) {
+        free(in);
+        free(out);
         close(srcfd);
-        return 4;
+        return 5;
     }
-
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+    while (ret == 0 && zret != Z_STREAM_END) {
+        bytes_read = read(srcfd, in, COPY_BUFFER_SIZE);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0) {
+            // truncated blob
+            ret = 5;
+            break;
+        }
+        strm.next_in = in;
+        strm.avail_in = bytes_read;
+        do {
+            strm.next_out = out;
+            strm.avail_out = COPY_BUFFER_SIZE;
+            zret = inflate(&strm, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END) {
+                ret = 5;
+                break;
+            }
+            size_t have = COPY_BUFFER_SIZE - strm.avail_out;
+            if (write(dstfd, out, have) != (ssize_t)have) {
+                ret = 5;
+                break;
+            }
+        } while (strm.avail_out == 0 && zret != Z_STREAM_END);
     }
 
-    close(dstfd);
+    inflateEnd(&strm);
+    free(in);
+    free(out);
     close(srcfd);
+    return ret;
+}
 
-    return 0;
+// append the contents of the blob of key to dstfd, whichever way it is stored
+static int append_blob(const char *blob_dir, const char *key, int dstfd) {
+    char blob_file[PATH_MAX];
+    struct stat st;
+    sprintf(blob_file, "%s/%s", blob_dir, key);
+    if (stat(blob_file, &st) == 0)
+        return append_file(blob_file, dstfd);
+    strcat(blob_file, COMPRESSED_SUFFIX);
+    return inflate_file(blob_file, dstfd);
 }
 
+// appendable text, for the "c" lines of chunked files
+struct text_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+// One manifest entry. Entries are written strictly in walk order; files are
+// hashed and stored by the workers (-j) and written once they are done.
+struct store_record {
+    char type;              // 'f', 'd' or 'l'
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    char *selabel;
+    char *name;             // as in the manifest
+    char *link;             // target of links
+    char *path;             // file to store, NULL for other entries
+    off_t size;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;           // 0 when it can't be trusted, see end_record()
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    struct text_buffer chunks;  // "c" lines of a chunked file
+    int done;
+    int ret;
+    struct store_record *next;
+};
+
+// A regular file of the previous manifest, see -p
+struct cache_entry {
+    char *path;
+    time_t mtime;
+    time_t ctime;
+    long long size;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    struct text_buffer chunks;
+    struct cache_entry *next;
+};
+
+// selabels are few, each is only written once to the string table
+struct label_entry {
+    char *label;
+    uint32_t offset;
+    struct label_entry *next;
+};
+
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
     FILE *output_manifest;
+    MD5_CTX manifest_md5;
     const char** excludes;
     int exclude_count;
+    struct cache_entry **cache;
+    int compress;
+
+    size_t chunk_min;
+    size_t chunk_max;
+    unsigned long long chunk_mask;
+
+    // manifest text of the entry being written
+    char *line;
+    size_t line_len;
+    size_t line_capacity;
+
+    // -b, the records go to output_manifest as they are written and the
+    // chunks and strings to temporary files, appended at the end
+    int binary;
+    FILE *chunks_file;
+    FILE *strings_file;
+    uint64_t record_count;
+    uint64_t chunk_count;
+    uint64_t strings_size;
+    struct label_entry *labels[64];
+
+    int jobs;
+    int next_worker_id;
+    pthread_t workers[MAX_JOBS];
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    struct store_record *head;
+    struct store_record *tail;
+    struct store_record *next_pending;
+    int in_flight;
+    int shutdown;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-j jobs] [-m md5_output] [-p previous_manifest] [-s min:avg:max] [-z] [-b] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x [-j jobs] input_manifest blob_dir output_directory\n", argv[0]);
     fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
+static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", filename);
+        return 1;
+    }
+    unsigned char *buf = malloc(COPY_BUFFER_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return 1;
+    }
 
+    SHA256_CTX c;
+    ssize_t rsize;
     SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+    while ((rsize = read(fd, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (rsize < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
         }
+        SHA256_Update(&c, buf, rsize);
     }
-
     SHA256_Final(rptr, &c);
-}
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
+    free(buf);
+    close(fd);
+    if (rsize < 0) {
+        fprintf(stderr, "Error reading file: %s\n", filename);
         return 1;
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
     return 0;
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+static char* tokenize(char *out, const char* line, const char sep);
+static void make_key(const unsigned char *sumdata, char *key);
+
+// A binary manifest mapped into memory, see dedupe_manifest.h
+struct binary_manifest {
+    void *map;
+    size_t map_size;
+    const struct dedupe_binary_header *header;
+    const struct dedupe_binary_record *records;
+    const struct dedupe_binary_chunk *chunks;
+    const char *strings;
+};
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, char *selabel, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%lu\t%lu\t%s\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, selabel, st.st_atime, st.st_mtime, st.st_ctime, f);
+// Returns 0 if manifest is a valid binary manifest, 1 if it is a text one.
+static int map_binary_manifest(const char *manifest, struct binary_manifest *binary) {
+    struct dedupe_binary_header header;
+    struct stat st;
+    int fd = open(manifest, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+            memcmp(header.magic, DEDUPE_BINARY_MAGIC, sizeof(DEDUPE_BINARY_MAGIC)) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    uint64_t size = st.st_size;
+    if (header.version > DEDUPE_BINARY_VERSION ||
+            header.record_size != sizeof(struct dedupe_binary_record) ||
+            header.records_offset > size ||
+            header.record_count > (size - header.records_offset) / sizeof(struct dedupe_binary_record) ||
+            header.chunks_offset > size ||
+            header.chunk_count > (size - header.chunks_offset) / sizeof(struct dedupe_binary_chunk) ||
+            header.strings_offset > size || header.strings_size == 0 ||
+            header.strings_size > size - header.strings_offset) {
+        fprintf(stderr, "Invalid or newer binary manifest %s\n", manifest);
+        close(fd);
+        return -1;
+    }
+
+    binary->map_size = size;
+    binary->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (binary->map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s\n", manifest);
+        return -1;
+    }
+    binary->header = (const struct dedupe_binary_header *)binary->map;
+    binary->records = (const struct dedupe_binary_record *)((const char *)binary->map + header.records_offset);
+    binary->chunks = (const struct dedupe_binary_chunk *)((const char *)binary->map + header.chunks_offset);
+    binary->strings = (const char *)binary->map + header.strings_offset;
+    // every string ends inside the table
+    if (binary->strings[header.strings_size - 1] != '\0') {
+        munmap(binary->map, size);
+        fprintf(stderr, "Invalid binary manifest %s\n", manifest);
+        return -1;
+    }
+    return 0;
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
-    int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret;
+static const char* binary_string(const struct binary_manifest *binary, uint32_t offset) {
+    if (offset >= binary->header->strings_size)
+        return "";
+    return binary->strings + offset;
+}
+
+// the chunks of a record, or NULL if they are out of bounds
+static const struct dedupe_binary_chunk* binary_chunks(const struct binary_manifest *binary, const struct dedupe_binary_record *record) {
+    if (record->first_chunk > binary->header->chunk_count ||
+            record->chunk_count > binary->header->chunk_count - record->first_chunk)
+        return NULL;
+    return binary->chunks + record->first_chunk;
+}
+
+static int text_append(struct text_buffer *text, const char *data, size_t len) {
+    if (text->len + len + 1 > text->capacity) {
+        size_t capacity = (text->len + len + 1) * 2;
+        char *grown = realloc(text->data, capacity);
+        if (grown == NULL)
+            return 1;
+        text->data = grown;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->len, data, len);
+    text->len += len;
+    text->data[text->len] = '\0';
+    return 0;
+}
+
+// append to the manifest text of the entry being written
+static void manifest_printf(struct DEDUPE_STORE_CONTEXT *context, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (context->line_len + len + 1 > context->line_capacity) {
+        size_t capacity = (context->line_len + len + 1) * 2;
+        char *line = realloc(context->line, capacity);
+        if (line == NULL)
+            return;
+        context->line = line;
+        context->line_capacity = capacity;
+    }
+    va_start(ap, fmt);
+    vsnprintf(context->line + context->line_len, len + 1, fmt, ap);
+    va_end(ap);
+    context->line_len += len;
+}
+
+// the manifest is hashed as it is written, see -m
+static int manifest_write(struct DEDUPE_STORE_CONTEXT *context, const char *data, size_t len) {
+    MD5_Update(&context->manifest_md5, data, len);
+    if (fwrite(data, 1, len, context->output_manifest) != len)
+        return 1;
+    return 0;
+}
+
+void print_stat(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record) {
+    manifest_printf(context, "%c\t%o\t%lu\t%lu\t%s\t%lu\t%lu\t%lu\t%s\t", record->type, (unsigned int)record->mode, (unsigned long)record->uid, (unsigned long)record->gid, record->selabel, (unsigned long)record->atime, (unsigned long)record->mtime, (unsigned long)record->ctime, record->name);
+}
+
+static unsigned int cache_hash(const char *path) {
+    unsigned int hash = 5381;
+    while (*path)
+        hash = hash * 33 + (unsigned char)*path++;
+    return hash % CACHE_BUCKETS;
+}
+
+// Remember the key of every regular file of a previous manifest of the same
+// input directory, so unchanged files don't have to be read again.
+static int load_binary_cache(struct DEDUPE_STORE_CONTEXT *context, struct binary_manifest *binary) {
+    uint64_t i;
+    uint32_t j;
+    int count = 0;
+    for (i = 0; i < binary->header->record_count; i++) {
+        const struct dedupe_binary_record *record = &binary->records[i];
+        const struct dedupe_binary_chunk *chunks = binary_chunks(binary, record);
+        if (record->type != 'f' || chunks == NULL)
+            continue;
+
+        const char *filename = binary_string(binary, record->path);
+        struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+        if (entry == NULL || (entry->path = strdup(filename)) == NULL) {
+            free(entry);
+            return count;
+        }
+        entry->mtime = record->mtime;
+        entry->ctime = record->ctime;
+        entry->size = record->size;
+        if (record->flags & DEDUPE_BINARY_CHUNKED) {
+            strcpy(entry->key, CHUNKED_KEY);
+            for (j = 0; j < record->chunk_count; j++) {
+                char key[SHA256_DIGEST_LENGTH * 2 + 2];
+                char line[128];
+                make_key(chunks[j].digest, key);
+                int len = snprintf(line, sizeof(line), "c\t%s\t%llu\t\n", key, (unsigned long long)chunks[j].size);
+                text_append(&entry->chunks, line, len);
+            }
+        } else {
+            make_key(record->digest, entry->key);
+        }
+        unsigned int bucket = cache_hash(filename);
+        entry->next = context->cache[bucket];
+        context->cache[bucket] = entry;
+        count++;
     }
+    return count;
+}
+
+static int load_cache(struct DEDUPE_STORE_CONTEXT *context, const char *manifest) {
+    struct binary_manifest binary;
+    int ret = map_binary_manifest(manifest, &binary);
+    if (ret < 0)
+        return 1;
+    if (ret == 0) {
+        context->cache = calloc(CACHE_BUCKETS, sizeof(struct cache_entry *));
+        if (context->cache != NULL)
+            fprintf(stderr, "Loaded %d cached keys from %s\n", load_binary_cache(context, &binary), manifest);
+        munmap(binary.map, binary.map_size);
+        return context->cache == NULL;
+    }
+
+    FILE *input_manifest = fopen(manifest, "rb");
+    if (input_manifest == NULL) {
+        fprintf(stderr, "Unable to open previous manifest %s\n", manifest);
+        return 1;
+    }
+
+    char line[PATH_MAX];
+    int version = 1;
+    if (fgets(line, PATH_MAX, input_manifest) == NULL ||
+            sscanf(line, "dedupe\t%d", &version) != 1 ||
+            version < 2 || version > DEDUPE_VERSION) {
+        // v1 manifests have no times to compare against
+        fclose(input_manifest);
+        return 0;
+    }
+
+    context->cache = calloc(CACHE_BUCKETS, sizeof(struct cache_entry *));
+    if (context->cache == NULL) {
+        fclose(input_manifest);
+        return 1;
+    }
+
+    int count = 0;
+    struct cache_entry *chunked = NULL;
+    while (fgets(line, PATH_MAX, input_manifest)) {
+        if (strncmp(line, "c\t", 2) == 0) {
+            if (chunked != NULL && text_append(&chunked->chunks, line, strlen(line)))
+                break;
+            continue;
+        }
+        chunked = NULL;
+
+        char type[4];
+        char mode[8];
+        char uid[32];
+        char gid[32];
+        char selabel[PATH_MAX];
+        char at[32];
+        char mt[32];
+        char ct[32];
+        char filename[PATH_MAX];
+        char key[128];
+        char sizeStr[32];
+
+        char *token = line;
+        if ((token = tokenize(type, token, '\t')) == NULL || strcmp(type, "f") != 0)
+            continue;
+        token = tokenize(mode, token, '\t');
+        if (token) token = tokenize(uid, token, '\t');
+        if (token) token = tokenize(gid, token, '\t');
+        if (token) token = tokenize(selabel, token, '\t');
+        if (token) token = tokenize(at, token, '\t');
+        if (token) token = tokenize(mt, token, '\t');
+        if (token) token = tokenize(ct, token, '\t');
+        if (token) token = tokenize(filename, token, '\t');
+        if (token) token = tokenize(key, token, '\t');
+        if (token) token = tokenize(sizeStr, token, '\t');
+        if (token == NULL || (strlen(key) != SHA256_DIGEST_LENGTH * 2 + 1 &&
+                strcmp(key, CHUNKED_KEY) != 0))
+            continue;
+
+        struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+        if (entry == NULL || (entry->path = strdup(filename)) == NULL) {
+            free(entry);
+            break;
+        }
+        entry->mtime = atol(mt);
+        entry->ctime = atol(ct);
+        entry->size = atoll(sizeStr);
+        strcpy(entry->key, key);
+        unsigned int bucket = cache_hash(filename);
+        entry->next = context->cache[bucket];
+        context->cache[bucket] = entry;
+        if (strcmp(key, CHUNKED_KEY) == 0)
+            chunked = entry;
+        count++;
+    }
+    fclose(input_manifest);
+    fprintf(stderr, "Loaded %d cached keys from %s\n", count, manifest);
+    return 0;
+}
+
+static void free_cache(struct DEDUPE_STORE_CONTEXT *context) {
+    int i;
+    if (context->cache == NULL)
+        return;
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        while (context->cache[i] != NULL) {
+            struct cache_entry *next = context->cache[i]->next;
+            free(context->cache[i]->path);
+            free(context->cache[i]->chunks.data);
+            free(context->cache[i]);
+            context->cache[i] = next;
+        }
+    }
+    free(context->cache);
+    context->cache = NULL;
+}
+
+// A raw blob of the wrong size is left over from an interrupted copy, the
+// compressed ones are only ever renamed into place once complete.
+static int blob_exists(struct DEDUPE_STORE_CONTEXT *context, const char *key, long long size) {
+    char blob[PATH_MAX];
+    struct stat blob_info;
+    sprintf(blob, "%s/%s", context->blob_dir, key);
+    if (stat(blob, &blob_info) == 0 && blob_info.st_size == size)
+        return 1;
+    strcat(blob, COMPRESSED_SUFFIX);
+    return stat(blob, &blob_info) == 0;
+}
+
+// every chunk of the "c" lines in chunks is in the blob dir
+static int chunks_exist(struct DEDUPE_STORE_CONTEXT *context, const char *chunks) {
+    char key[128];
+    char sizeStr[32];
+    while (*chunks != '\0') {
+        const char *token = chunks + 2;
+        token = tokenize(key, token, '\t');
+        if (token) token = tokenize(sizeStr, token, '\t');
+        if (token == NULL || !blob_exists(context, key, atoll(sizeStr)))
+            return 0;
+        chunks = strchr(token, '\n');
+        if (chunks == NULL)
+            return 0;
+        chunks++;
+    }
+    return 1;
+}
+
+// ctime can't be set from userspace, so a file with the same path, size,
+// mtime and ctime as in the previous manifest still has the same content.
+static struct cache_entry* find_cached(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record) {
+    struct cache_entry *entry;
+    if (context->cache == NULL)
+        return NULL;
+    if (record->ctime == 0)
+        return NULL;
+    for (entry = context->cache[cache_hash(record->path)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, record->path) == 0) {
+            if (entry->size == record->size && entry->mtime == record->mtime &&
+                    entry->ctime == record->ctime)
+                return entry;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// if a hash is abcdefg,
+// the output blob name is abc/defg
+// this is to get around vfat having a 64k directory size limit (usually around 20k files)
+static void make_key(const unsigned char *sumdata, char *key) {
     char psum[128];
     int j;
     for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
         sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
     psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
 
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
-    char out_blob[PATH_MAX];
-    char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
     strcpy(key, psum);
     key[3] = '/';
     key[4] = NULL;
     strcat(key, psum + 3);
-    sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
+}
+
+// Name the blob of key and its temporary file, and create its shard dir.
+// worker is used to keep the temporary files of concurrent workers apart.
+static void prepare_blob(struct DEDUPE_STORE_CONTEXT *context, const char *key, const char *suffix, int worker, char *out_blob, char *tmp_out_blob) {
+    sprintf(out_blob, "%s/%s%s", context->blob_dir, key, suffix);
+    if (worker < 0)
+        sprintf(tmp_out_blob, "%s.tmp", out_blob);
+    else
+        sprintf(tmp_out_blob, "%s.tmp%d", out_blob, worker);
     //when BUILD_HOST_EXECUTABLE, dirname(out_blob) will change out_blob
     char out_blob_dir[PATH_MAX];
     strcpy(out_blob_dir, out_blob);
     mkdir(dirname(out_blob_dir), S_IRWXU | S_IRWXG | S_IRWXO);
+}
+
+// The contents of a new blob: a file, or a chunk already in memory.
+struct blob_source {
+    const char *path;
+    int fd;
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+};
+
+static ssize_t source_read(struct blob_source *src, unsigned char *buf, size_t len) {
+    if (src->data == NULL) {
+        ssize_t n;
+        do {
+            n = read(src->fd, buf, len);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+    if (len > src->len - src->pos)
+        len = src->len - src->pos;
+    memcpy(buf, src->data + src->pos, len);
+    src->pos += len;
+    return len;
+}
+
+static int source_rewind(struct blob_source *src) {
+    src->pos = 0;
+    if (src->data == NULL && lseek(src->fd, 0, SEEK_SET) != 0)
+        return 1;
+    return 0;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_raw_blob(struct blob_source *src, int fd) {
+    unsigned char *buf = malloc(COPY_BUFFER_SIZE);
+    ssize_t n;
+    int ret = 0;
+    if (buf == NULL)
+        return ENOMEM;
+    while (ret == 0 && (n = source_read(src, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (n < 0 || write_all(fd, buf, n))
+            ret = 5;
+    }
+    free(buf);
+    return ret;
+}
+
+// Returns -1 if the data does not compress well enough to be worth it.
+static int write_compressed_blob(struct blob_source *src, int fd) {
+    unsigned char *in = malloc(COPY_BUFFER_SIZE);
+    unsigned char *out = malloc(COPY_BUFFER_SIZE);
+    int ret = 0, flush = Z_NO_FLUSH;
+    int sampled = 0;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    if (in == NULL || out == NULL ||
+            deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(in);
+        free(out);
+        return ENOMEM;
+    }
+    while (ret == 0 && flush != Z_FINISH) {
+        ssize_t n = source_read(src, in, COPY_BUFFER_SIZE);
+        if (n < 0) {
+            ret = 5;
+            break;
+        }
+        if (n == 0)
+            flush = Z_FINISH;
+        strm.next_in = in;
+        strm.avail_in = n;
+        do {
+            strm.next_out = out;
+            strm.avail_out = COPY_BUFFER_SIZE;
+            deflate(&strm, flush);
+            if (write_all(fd, out, COPY_BUFFER_SIZE - strm.avail_out)) {
+                ret = 5;
+                break;
+            }
+        } while (strm.avail_out == 0);
+
+        // APKs, media and the like are already compressed
+        if (!sampled && strm.total_in >= COMPRESS_SAMPLE_SIZE) {
+            sampled = 1;
+            if (strm.total_out > strm.total_in / 10 * 9)
+                ret = -1;
+        }
+    }
+    if (ret == 0 && strm.total_out > strm.total_in / 10 * 9)
+        ret = -1;
+
+    deflateEnd(&strm);
+    free(in);
+    free(out);
+    return ret;
+}
+
+static int write_blob_file(struct blob_source *src, const char *tmp_out_blob, const char *out_blob, int compress) {
+    int fd = open(tmp_out_blob, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 4;
+    int ret = compress ? write_compressed_blob(src, fd) : write_raw_blob(src, fd);
+    if (close(fd) != 0 && ret == 0)
+        ret = 5;
+    if (ret == 0 && rename(tmp_out_blob, out_blob) != 0)
+        ret = 5;
+    if (ret != 0)
+        unlink(tmp_out_blob);
+    return ret;
+}
+
+// Write the blob of key, compressed with -z when that saves space.
+static int write_blob(struct DEDUPE_STORE_CONTEXT *context, const char *key, struct blob_source *src, int worker) {
+    char out_blob[PATH_MAX];
+    char tmp_out_blob[PATH_MAX];
+    int ret;
+
+    if (context->compress) {
+        prepare_blob(context, key, COMPRESSED_SUFFIX, worker, out_blob, tmp_out_blob);
+        ret = write_blob_file(src, tmp_out_blob, out_blob, 1);
+        if (ret != -1)
+            return ret;
+        if (source_rewind(src))
+            return 5;
+    }
+    prepare_blob(context, key, "", worker, out_blob, tmp_out_blob);
+    return write_blob_file(src, tmp_out_blob, out_blob, 0);
+}
+
+// Hash a file and copy it into the blob store unless it is already there.
+static int store_whole_blob(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record, int worker) {
+    const char *f = record->path;
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    int ret;
+
+    if ((ret = do_sha256sum_file(f, sumdata)) != 0) {
+        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
+        return ret;
+    }
+    make_key(sumdata, record->key);
+
+    // don't copy the file if it exists? not quite sure how I feel about this.
+    // verify the file exists and is of the same size
+    if (!blob_exists(context, record->key, record->size)) {
+        struct blob_source src;
+        memset(&src, 0, sizeof(src));
+        src.fd = open(f, O_RDONLY);
+        if (src.fd < 0)
+            ret = 3;
+        else {
+            ret = write_blob(context, record->key, &src, worker);
+            close(src.fd);
+        }
+        if (ret) {
+            fprintf(stderr, "Error copying blob %s\n", f);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Gear hash: each byte shifts the previous ones further out, so the top bits
+// only depend on the last 64 bytes and boundaries resynchronize after an edit.
+static unsigned long long gear[256];
+
+static void init_gear() {
+    // fixed seed, chunk boundaries must be stable across runs
+    unsigned long long x = 0x6465647570650003ULL;
+    int i;
+    for (i = 0; i < 256; i++) {
+        // splitmix64
+        unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// length of the chunk at the start of buf; the whole of len at end of file
+static size_t find_chunk_end(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *buf, size_t len) {
+    unsigned long long hash = 0;
+    size_t i;
+    if (len <= context->chunk_min)
+        return len;
+    // the hash only needs the 64 bytes before the minimum chunk size
+    i = context->chunk_min > 64 ? context->chunk_min - 64 : 0;
+    for (; i < len; i++) {
+        hash = (hash << 1) + gear[buf[i]];
+        if (i + 1 >= context->chunk_min && (hash & context->chunk_mask) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+static int store_chunk(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *data, size_t len, int worker, struct text_buffer *chunks) {
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    int ret;
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    SHA256_Update(&c, data, len);
+    SHA256_Final(sumdata, &c);
+    make_key(sumdata, key);
+
+    if (!blob_exists(context, key, len)) {
+        struct blob_source src;
+        memset(&src, 0, sizeof(src));
+        src.data = data;
+        src.len = len;
+        if ((ret = write_blob(context, key, &src, worker)))
+            return ret;
+    }
+
+    char line[128];
+    int line_len = snprintf(line, sizeof(line), "c\t%s\t%lu\t\n", key, (unsigned long)len);
+    return text_append(chunks, line, line_len) ? ENOMEM : 0;
+}
+
+// Split a file into content-defined chunks and store each of them as a blob.
+static int store_chunked_blob(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record, int worker) {
+    const char *f = record->path;
+    int fd = open(f, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", f);
+        return 1;
+    }
+    unsigned char *buf = malloc(context->chunk_max);
+    if (buf == NULL) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    int ret = 0;
+    int eof = 0;
+    size_t filled = 0;
+    long long total = 0;
+    while (ret == 0) {
+        while (!eof && filled < context->chunk_max) {
+            ssize_t n = read(fd, buf + filled, context->chunk_max - filled);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                fprintf(stderr, "Error reading file: %s\n", f);
+                ret = 1;
+                break;
+            }
+            if (n == 0)
+                eof = 1;
+            filled += n;
+        }
+        if (ret != 0 || filled == 0)
+            break;
+
+        size_t len = find_chunk_end(context, buf, filled);
+        if ((ret = store_chunk(context, buf, len, worker, &record->chunks))) {
+            fprintf(stderr, "Error copying blob %s\n", f);
+            break;
+        }
+        total += len;
+        memmove(buf, buf + len, filled - len);
+        filled -= len;
+    }
+
+    free(buf);
+    close(fd);
+    strcpy(record->key, CHUNKED_KEY);
+    // the chunks must add up to the recorded size if the file changed meanwhile
+    record->size = total;
+    return ret;
+}
+
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record, int worker) {
+    struct cache_entry *cached = find_cached(context, record);
+    // only trust the cache while the blobs are still around
+    if (cached != NULL) {
+        if (strcmp(cached->key, CHUNKED_KEY) == 0) {
+            if (cached->chunks.data != NULL && chunks_exist(context, cached->chunks.data) &&
+                    text_append(&record->chunks, cached->chunks.data, cached->chunks.len) == 0) {
+                strcpy(record->key, CHUNKED_KEY);
+                return 0;
+            }
+            record->chunks.len = 0;
+        } else if (blob_exists(context, cached->key, record->size)) {
+            strcpy(record->key, cached->key);
+            return 0;
+        }
+    }
+
+    if (record->size > context->chunk_max)
+        return store_chunked_blob(context, record, worker);
+    return store_whole_blob(context, record, worker);
+}
+
+static void free_record(struct store_record *record) {
+    free(record->selabel);
+    free(record->name);
+    free(record->link);
+    free(record->path);
+    free(record->chunks.data);
+    free(record);
+}
+
+static void* store_worker(void *cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT *)cookie;
+    pthread_mutex_lock(&context->lock);
+    int worker = context->next_worker_id++;
+    while (1) {
+        while (!context->shutdown && context->next_pending == NULL)
+            pthread_cond_wait(&context->work_cond, &context->lock);
+        struct store_record *record = context->next_pending;
+        if (context->shutdown || record == NULL)
+            break;
+        struct store_record *next = record->next;
+        while (next != NULL && next->path == NULL)
+            next = next->next;
+        context->next_pending = next;
+        pthread_mutex_unlock(&context->lock);
+
+        int ret = store_blob(context, record, worker);
+
+        pthread_mutex_lock(&context->lock);
+        record->ret = ret;
+        record->done = 1;
+        pthread_cond_broadcast(&context->done_cond);
+    }
+    pthread_mutex_unlock(&context->lock);
+    return NULL;
+}
+
+static int write_text_record(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record) {
+    context->line_len = 0;
+    print_stat(context, record);
+    if (record->type == 'f')
+        manifest_printf(context, "%s\t%lld\t\n", record->key, (long long)record->size);
+    else if (record->type == 'l')
+        manifest_printf(context, "%s\t\n", record->link);
+    else
+        manifest_printf(context, "\n");
+    if (context->line == NULL || manifest_write(context, context->line, context->line_len))
+        return 1;
+    if (record->chunks.len > 0 && manifest_write(context, record->chunks.data, record->chunks.len))
+        return 1;
+    return 0;
+}
+
+static int add_string(struct DEDUPE_STORE_CONTEXT *context, const char *string, uint32_t *offset) {
+    size_t len = strlen(string) + 1;
+    *offset = 0;
+    if (len == 1)
+        return 0;
+    if (fwrite(string, 1, len, context->strings_file) != len)
+        return 1;
+    *offset = context->strings_size;
+    context->strings_size += len;
+    return 0;
+}
+
+static int add_label(struct DEDUPE_STORE_CONTEXT *context, const char *label, uint32_t *offset) {
+    struct label_entry **bucket = &context->labels[cache_hash(label) % 64];
+    struct label_entry *entry;
+    for (entry = *bucket; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->label, label) == 0) {
+            *offset = entry->offset;
+            return 0;
+        }
+    }
+    if (add_string(context, label, offset))
+        return 1;
+    entry = malloc(sizeof(struct label_entry));
+    if (entry == NULL || (entry->label = strdup(label)) == NULL) {
+        free(entry);
+        return 0;
+    }
+    entry->offset = *offset;
+    entry->next = *bucket;
+    *bucket = entry;
+    return 0;
+}
+
+static int parse_digest(const char *hex, unsigned char *digest);
+
+static int write_binary_record(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record) {
+    struct dedupe_binary_record out;
+    memset(&out, 0, sizeof(out));
+    out.type = record->type;
+    out.mode = record->mode;
+    out.uid = record->uid;
+    out.gid = record->gid;
+    out.atime = record->atime;
+    out.mtime = record->mtime;
+    out.ctime = record->ctime;
+    if (add_string(context, record->name, &out.path) ||
+            add_label(context, record->selabel, &out.selabel))
+        return 1;
+    if (record->type == 'l' && add_string(context, record->link, &out.target))
+        return 1;
+    if (record->type == 'f') {
+        out.size = record->size;
+        if (strcmp(record->key, CHUNKED_KEY) == 0) {
+            // the "c" lines of store_chunk()
+            const char *chunks = record->chunks.data;
+            out.flags = DEDUPE_BINARY_CHUNKED;
+            out.first_chunk = context->chunk_count;
+            while (chunks != NULL && *chunks != '\0') {
+                struct dedupe_binary_chunk chunk;
+                int len = parse_digest(chunks + 2, chunk.digest);
+                if (len < 0)
+                    return 1;
+                chunk.size = strtoull(chunks + 2 + len + 1, NULL, 10);
+                if (fwrite(&chunk, sizeof(chunk), 1, context->chunks_file) != 1)
+                    return 1;
+                context->chunk_count++;
+                out.chunk_count++;
+                chunks = strchr(chunks, '\n');
+                if (chunks != NULL)
+                    chunks++;
+            }
+        } else if (parse_digest(record->key, out.digest) < 0) {
+            return 1;
+        }
+    }
+    context->record_count++;
+    return manifest_write(context, (const char *)&out, sizeof(out));
+}
+
+static int write_record(struct DEDUPE_STORE_CONTEXT *context, struct store_record *record) {
+    if (record->ret)
+        return record->ret;
+    if (context->binary)
+        return write_binary_record(context, record);
+    return write_text_record(context, record);
+}
+
+static int append_stream(FILE *src, FILE *dst) {
+    char buf[COPY_BUFFER_SIZE];
+    size_t n;
+    if (fflush(src) != 0 || fseek(src, 0, SEEK_SET) != 0)
+        return 1;
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
+        if (fwrite(buf, 1, n, dst) != n)
+            return 1;
+    }
+    return ferror(src) ? 1 : 0;
+}
 
-    // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
-    struct stat file_info;
-    // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
-    }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
-            return ret;
+// Append the chunks and strings of a binary manifest and fill in its header.
+// The header changes last, so the manifest is hashed again for -m.
+static int finish_binary_manifest(struct DEDUPE_STORE_CONTEXT *context) {
+    struct dedupe_binary_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEDUPE_BINARY_MAGIC, sizeof(DEDUPE_BINARY_MAGIC));
+    header.version = DEDUPE_BINARY_VERSION;
+    header.record_size = sizeof(struct dedupe_binary_record);
+    header.record_count = context->record_count;
+    header.chunk_count = context->chunk_count;
+    header.records_offset = sizeof(header);
+    header.chunks_offset = header.records_offset + header.record_count * sizeof(struct dedupe_binary_record);
+    header.strings_offset = header.chunks_offset + header.chunk_count * sizeof(struct dedupe_binary_chunk);
+    header.strings_size = context->strings_size;
+
+    FILE *out = context->output_manifest;
+    if (append_stream(context->chunks_file, out) || append_stream(context->strings_file, out))
+        return 1;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fflush(out) != 0 || fseek(out, 0, SEEK_SET) != 0)
+        return 1;
+
+    char buf[COPY_BUFFER_SIZE];
+    size_t n;
+    MD5_Init(&context->manifest_md5);
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0)
+        MD5_Update(&context->manifest_md5, buf, n);
+    return ferror(out) ? 1 : 0;
+}
+
+// Write out the finished entries at the head of the queue. Blocks while the
+// queue is full, or until it is empty if wait_all is set.
+static int flush_records(struct DEDUPE_STORE_CONTEXT *context, int wait_all) {
+    int ret = 0;
+    pthread_mutex_lock(&context->lock);
+    while (context->head != NULL) {
+        struct store_record *record = context->head;
+        if (!record->done) {
+            if (!wait_all && context->in_flight < context->jobs * 16)
+                break;
+            pthread_cond_wait(&context->done_cond, &context->lock);
+            continue;
         }
+        context->head = record->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->in_flight--;
+        pthread_mutex_unlock(&context->lock);
+
+        ret = write_record(context, record);
+        free_record(record);
+
+        pthread_mutex_lock(&context->lock);
+        if (ret)
+            break;
     }
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
-    return 0;
+// Queue the entry of s. Regular files are stored in the blob dir, link is
+// the target of links.
+static int end_record(struct DEDUPE_STORE_CONTEXT *context, char type, const struct stat *st, const char *selabel, const char *s, const char *link) {
+    struct store_record *record = calloc(1, sizeof(struct store_record));
+    if (record == NULL)
+        return ENOMEM;
+    record->type = type;
+    record->mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    record->uid = st->st_uid;
+    record->gid = st->st_gid;
+    record->size = st->st_size;
+    record->atime = st->st_atime;
+    record->mtime = st->st_mtime;
+    record->ctime = st->st_ctime;
+    // ctime is only used by -p. A file changed within the current second can
+    // change again without moving it, so don't let the next backup trust it.
+    if (record->ctime >= time(NULL))
+        record->ctime = 0;
+    record->selabel = strdup(selabel);
+    record->name = strdup(s);
+    record->link = strdup(link != NULL ? link : "");
+    record->done = 1;
+    if (record->selabel == NULL || record->name == NULL || record->link == NULL) {
+        free_record(record);
+        return ENOMEM;
+    }
+    if (type == 'f') {
+        record->path = strdup(s);
+        if (record->path == NULL) {
+            free_record(record);
+            return ENOMEM;
+        }
+        if (context->jobs > 1)
+            record->done = 0;
+        else
+            record->ret = store_blob(context, record, -1);
+    }
+
+    pthread_mutex_lock(&context->lock);
+    if (context->tail != NULL)
+        context->tail->next = record;
+    else
+        context->head = record;
+    context->tail = record;
+    context->in_flight++;
+    if (!record->done) {
+        if (context->next_pending == NULL)
+            context->next_pending = record;
+        pthread_cond_signal(&context->work_cond);
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    return flush_records(context, 0);
+}
+
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char *selabel, const char* f) {
+    printf("%s\n", f);
+    return end_record(context, 'f', &st, selabel, f, NULL);
 }
 
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
@@ -206,40 +1280,41 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     return 0;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
+static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char *selabel, const char* l) {
     printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    int ret = readlink(l, link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+    return end_record(context, 'l', &st, selabel, l, link);
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
     char* selabel = NULL;
+    int ret;
     if (lgetfilecon(s, &selabel) < 0) {
         fprintf(stderr, "Can't get %s context\n", s);
         selabel = strdup("unlabel");
     }
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, selabel, s);
+        ret = store_file(context, st, selabel, s);
         freecon(selabel);
-        return store_file(context, st, s);
+        return ret;
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, selabel, s);
-        fprintf(context->output_manifest, "\n");
+        ret = end_record(context, 'd', &st, selabel, s, NULL);
         freecon(selabel);
+        if (ret)
+            return ret;
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, selabel, s);
+        ret = store_link(context, st, selabel, s);
         freecon(selabel);
-        return store_link(context, st, s);
+        return ret;
     }
     else {
         fprintf(stderr, "Skipping special: %s\n", s);
@@ -248,6 +1323,80 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
+// Runs the store of input_dir, see "dedupe c".
+static int store(struct DEDUPE_STORE_CONTEXT *context, struct stat st) {
+    int ret = 0;
+    int i;
+
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->work_cond, NULL);
+    pthread_cond_init(&context->done_cond, NULL);
+    context->head = context->tail = context->next_pending = NULL;
+    context->in_flight = 0;
+    context->shutdown = 0;
+    context->next_worker_id = 0;
+    context->line = NULL;
+    context->line_len = context->line_capacity = 0;
+
+    int workers = 0;
+    if (context->jobs > 1) {
+        for (workers = 0; workers < context->jobs; workers++) {
+            if (pthread_create(&context->workers[workers], NULL, store_worker, context))
+                break;
+        }
+        if (workers == 0)
+            context->jobs = 1;
+    }
+
+    if (context->binary) {
+        // filled in by finish_binary_manifest()
+        struct dedupe_binary_header header;
+        memset(&header, 0, sizeof(header));
+        ret = fwrite(&header, sizeof(header), 1, context->output_manifest) != 1;
+        // offset 0 is the empty string
+        if (fputc('\0', context->strings_file) == EOF)
+            ret = 1;
+        context->strings_size = 1;
+    } else {
+        manifest_printf(context, "dedupe\t%d\n", DEDUPE_VERSION);
+        ret = context->line == NULL || manifest_write(context, context->line, context->line_len);
+    }
+    if (ret == 0)
+        ret = store_dir(context, st, ".");
+    if (ret == 0)
+        ret = flush_records(context, 1);
+    if (ret == 0 && context->binary)
+        ret = finish_binary_manifest(context);
+
+    pthread_mutex_lock(&context->lock);
+    context->shutdown = 1;
+    pthread_cond_broadcast(&context->work_cond);
+    pthread_mutex_unlock(&context->lock);
+    for (i = 0; i < workers; i++)
+        pthread_join(context->workers[i], NULL);
+
+    // entries left behind by an error
+    while (context->head != NULL) {
+        struct store_record *next = context->head->next;
+        free_record(context->head);
+        context->head = next;
+    }
+    free(context->line);
+    free_cache(context);
+    for (i = 0; i < 64; i++) {
+        while (context->labels[i] != NULL) {
+            struct label_entry *next = context->labels[i]->next;
+            free(context->labels[i]->label);
+            free(context->labels[i]);
+            context->labels[i] = next;
+        }
+    }
+    pthread_mutex_destroy(&context->lock);
+    pthread_cond_destroy(&context->work_cond);
+    pthread_cond_destroy(&context->done_cond);
+    return ret;
+}
+
 static char* tokenize(char *out, const char* line, const char sep) {
     while (*line != sep) {
         if (*line == '\0') {
@@ -277,78 +1426,596 @@ static int dec_to_oct(int dec) {
     return ret;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
+// Set of the binary digests of the blobs referenced by the manifests, see gc.
+// Open addressing with linear probing; an all zero slot is empty.
+struct digest_set {
+    unsigned char *slots;
+    size_t capacity;
+    size_t count;
+    int has_zero;
 };
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+static int digest_set_init(struct digest_set *set, size_t capacity) {
+    set->slots = calloc(capacity, SHA256_DIGEST_LENGTH);
+    set->capacity = capacity;
+    set->count = 0;
+    set->has_zero = 0;
+    return set->slots == NULL;
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
-        }
+static int is_zero_digest(const unsigned char *digest) {
+    int i;
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        if (digest[i] != 0)
+            return 0;
     }
+    return 1;
+}
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
+// the digests are uniformly distributed already
+static unsigned char* digest_set_slot(struct digest_set *set, const unsigned char *digest) {
+    size_t mask = set->capacity - 1;
+    size_t i = (((size_t)digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | digest[3]) & mask;
+    while (1) {
+        unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+        if (is_zero_digest(slot) || memcmp(slot, digest, SHA256_DIGEST_LENGTH) == 0)
+            return slot;
+        i = (i + 1) & mask;
     }
-    arr->size = 0;
-    arr->capacity = 0;
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
+static int digest_set_add(struct digest_set *set, const unsigned char *digest) {
+    if (is_zero_digest(digest)) {
+        set->has_zero = 1;
+        return 0;
+    }
+    // keep the load under 3/4
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+        struct digest_set grown;
+        size_t i;
+        if (digest_set_init(&grown, set->capacity * 2))
+            return 1;
+        for (i = 0; i < set->capacity; i++) {
+            unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+            if (!is_zero_digest(slot))
+                memcpy(digest_set_slot(&grown, slot), slot, SHA256_DIGEST_LENGTH);
+        }
+        grown.count = set->count;
+        grown.has_zero = set->has_zero;
+        free(set->slots);
+        *set = grown;
     }
-    arr->data[arr->size++] = val;
+    unsigned char *slot = digest_set_slot(set, digest);
+    if (is_zero_digest(slot)) {
+        memcpy(slot, digest, SHA256_DIGEST_LENGTH);
+        set->count++;
+    }
+    return 0;
 }
 
-static int string_compare(const void* a, const void* b) {
-    return strcmp(*(char**) a, *(char **) b);
+static int digest_set_contains(struct digest_set *set, const unsigned char *digest) {
+    if (is_zero_digest(digest))
+        return set->has_zero;
+    return !is_zero_digest(digest_set_slot(set, digest));
 }
 
-static void recursive_list_dir(char* d, struct array *arr) {
-    DIR *dp = opendir(d);
-    if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
-        return;
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Parse the SHA256_DIGEST_LENGTH * 2 hex digits of hex, skipping the '/' of
+// keys. Returns the number of characters used, or -1.
+static int parse_digest(const char *hex, unsigned char *digest) {
+    const char *p = hex;
+    int i;
+    for (i = 0; i < SHA256_DIGEST_LENGTH * 2; i++) {
+        if (i == 3 && *p == '/')
+            p++;
+        int v = hex_value(*p++);
+        if (v < 0)
+            return -1;
+        if (i % 2 == 0)
+            digest[i / 2] = v << 4;
+        else
+            digest[i / 2] |= v;
     }
-    struct dirent *ep;
-    while ((ep = readdir(dp))) {
-        if (strcmp(ep->d_name, ".") == 0)
-            continue;
-        if (strcmp(ep->d_name, "..") == 0)
+    return p - hex;
+}
+
+static int scan_binary_manifest(struct binary_manifest *binary, struct digest_set *used) {
+    uint64_t i;
+    for (i = 0; i < binary->header->record_count; i++) {
+        const struct dedupe_binary_record *record = &binary->records[i];
+        if (record->type == 'f' && !(record->flags & DEDUPE_BINARY_CHUNKED) &&
+                digest_set_add(used, record->digest))
+            return 1;
+    }
+    for (i = 0; i < binary->header->chunk_count; i++) {
+        if (digest_set_add(used, binary->chunks[i].digest))
+            return 1;
+    }
+    return 0;
+}
+
+// Add the blobs referenced by a manifest to used.
+static int scan_manifest(const char *manifest, struct digest_set *used) {
+    struct binary_manifest binary;
+    int ret = map_binary_manifest(manifest, &binary);
+    if (ret < 0)
+        return 1;
+    if (ret == 0) {
+        ret = scan_binary_manifest(&binary, used);
+        if (ret)
+            fprintf(stderr, "Out of memory\n");
+        munmap(binary.map, binary.map_size);
+        return ret;
+    }
+
+    FILE *input_manifest = fopen(manifest, "rb");
+    if (input_manifest == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
+        return 1;
+    }
+
+    char line[PATH_MAX];
+    int version = 1;
+    if (fgets(line, PATH_MAX, input_manifest) == NULL) {
+        fclose(input_manifest);
+        return 0;
+    }
+    if (sscanf(line, "dedupe\t%d", &version) != 1) {
+        fseek(input_manifest, 0, SEEK_SET);
+    }
+    if (version > DEDUPE_VERSION) {
+        fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", manifest);
+        fclose(input_manifest);
+        return 1;
+    }
+
+    ret = 0;
+    while (ret == 0 && fgets(line, PATH_MAX, input_manifest)) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        char key[128];
+        char *token = line;
+
+        if (strncmp(line, "c\t", 2) == 0) {
+            token = tokenize(key, line + 2, '\t');
+        } else if (strncmp(line, "f\t", 2) == 0) {
+            // type mode uid gid selabel [atime mtime ctime] filename key
+            int fields = version >= 2 ? 9 : 6;
+            while (token != NULL && fields-- > 0) {
+                token = strchr(token, '\t');
+                if (token != NULL)
+                    token++;
+            }
+            if (token != NULL)
+                token = tokenize(key, token, '\t');
+            if (token != NULL && strcmp(key, CHUNKED_KEY) == 0)
+                continue;
+        } else {
             continue;
-        struct stat cst;
-        int ret;
-        char blob[PATH_MAX];
-        sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
+        }
+
+        if (token == NULL || parse_digest(key, digest) < 0) {
+            // don't risk deleting what a damaged manifest still needs
+            fprintf(stderr, "Invalid entry in %s: %s", manifest, line);
+            ret = 1;
+            break;
+        }
+        if (digest_set_add(used, digest)) {
+            fprintf(stderr, "Out of memory\n");
+            ret = 1;
+        }
+    }
+    fclose(input_manifest);
+    return ret;
+}
+
+// Walk the 4096 shard dirs and delete whatever isn't a referenced blob,
+// leftover temporary files included.
+static int sweep_blobs(const char *blob_dir, struct digest_set *used, int *deleted) {
+    char shard[PATH_MAX];
+    char blob[PATH_MAX];
+    int i;
+    for (i = 0; i < 4096; i++) {
+        sprintf(shard, "%s/%03x", blob_dir, i);
+        DIR *dp = opendir(shard);
+        if (dp == NULL)
             continue;
+        struct dirent *ep;
+        while ((ep = readdir(dp))) {
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            char key[SHA256_DIGEST_LENGTH * 2 + 2];
+            if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+                continue;
+
+            // abc/defg... or abc/defg....gz
+            snprintf(key, sizeof(key), "%03x/%s", i, ep->d_name);
+            int len = parse_digest(key, digest);
+            const char *suffix = ep->d_name + (len - 4);
+            if (len > 0 && (*suffix == '\0' || strcmp(suffix, COMPRESSED_SUFFIX) == 0) &&
+                    digest_set_contains(used, digest))
+                continue;
+
+            sprintf(blob, "%s/%s", shard, ep->d_name);
+            if (remove(blob)) {
+                fprintf(stderr, "Error removing: %s\n", blob);
+            } else {
+                (*deleted)++;
+            }
+            printf("Delete: %s\n", blob);
+        }
+        closedir(dp);
+    }
+    return 0;
+}
+
+static int restore_blob(const char *blob_dir, const unsigned char *digest, const char *filename) {
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    make_key(digest, key);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 4;
+    int ret = append_blob(blob_dir, key, fd);
+    if (close(fd) != 0 && ret == 0)
+        ret = 5;
+    return ret;
+}
+
+// Concatenate the chunks of a chunked file.
+static int restore_chunks(const char *blob_dir, const char *filename, long long size, const struct dedupe_binary_chunk *chunks, uint32_t chunk_count) {
+    long long total = 0;
+    uint32_t i;
+    int ret = 0;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 4;
+    for (i = 0; ret == 0 && i < chunk_count; i++) {
+        char key[SHA256_DIGEST_LENGTH * 2 + 2];
+        make_key(chunks[i].digest, key);
+        ret = append_blob(blob_dir, key, fd);
+        total += chunks[i].size;
+    }
+    if (close(fd) != 0 && ret == 0)
+        ret = 5;
+    if (ret == 0 && total != size) {
+        fprintf(stderr, "Chunks of %s don't add up to its size\n", filename);
+        ret = 1;
+    }
+    return ret;
+}
+
+// One manifest entry of "dedupe x". The strings and chunks point into the
+// binary manifest when there is one.
+struct restore_entry {
+    char type;
+    int mode;
+    int uid;
+    int gid;
+    long atime;
+    long mtime;
+    const char *selabel;
+    const char *filename;
+    const char *target;     // target of links
+    long long size;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int chunked;
+    const struct dedupe_binary_chunk *chunks;
+    uint32_t chunk_count;
+    int ret;
+};
+
+struct DEDUPE_RESTORE_CONTEXT {
+    const char *blob_dir;
+    int version;
+    struct binary_manifest binary;
+    int mapped;
+    struct restore_entry *entries;
+    int count;
+    int capacity;
+
+    // files are copied by the workers, next is the next entry to look at
+    pthread_mutex_t lock;
+    int next;
+};
+
+static void free_entries(struct DEDUPE_RESTORE_CONTEXT *context) {
+    int i;
+    if (context->mapped) {
+        munmap(context->binary.map, context->binary.map_size);
+    } else {
+        for (i = 0; i < context->count; i++) {
+            free((char *)context->entries[i].selabel);
+            free((char *)context->entries[i].filename);
+            free((char *)context->entries[i].target);
+            free((void *)context->entries[i].chunks);
+        }
+    }
+    free(context->entries);
+}
+
+static struct restore_entry* add_entry(struct DEDUPE_RESTORE_CONTEXT *context) {
+    if (context->count == context->capacity) {
+        int capacity = context->capacity == 0 ? 1024 : context->capacity * 2;
+        struct restore_entry *grown = realloc(context->entries, capacity * sizeof(struct restore_entry));
+        if (grown == NULL)
+            return NULL;
+        context->entries = grown;
+        context->capacity = capacity;
+    }
+    struct restore_entry *entry = &context->entries[context->count++];
+    memset(entry, 0, sizeof(struct restore_entry));
+    return entry;
+}
+
+static int read_binary_manifest(struct DEDUPE_RESTORE_CONTEXT *context, const char *name) {
+    const struct binary_manifest *binary = &context->binary;
+    uint64_t i;
+    context->version = DEDUPE_VERSION;
+    for (i = 0; i < binary->header->record_count; i++) {
+        const struct dedupe_binary_record *record = &binary->records[i];
+        if (record->type != 'f' && record->type != 'l' && record->type != 'd') {
+            fprintf(stderr, "Unknown type %c\n", record->type);
+            return 1;
         }
+        struct restore_entry *entry = add_entry(context);
+        if (entry == NULL)
+            return ENOMEM;
+        entry->type = record->type;
+        entry->mode = record->mode;
+        entry->uid = record->uid;
+        entry->gid = record->gid;
+        entry->atime = record->atime;
+        entry->mtime = record->mtime;
+        entry->selabel = binary_string(binary, record->selabel);
+        entry->filename = binary_string(binary, record->path);
+        entry->target = binary_string(binary, record->target);
+        entry->size = record->size;
+        memcpy(entry->digest, record->digest, SHA256_DIGEST_LENGTH);
+        if (record->type == 'f' && (record->flags & DEDUPE_BINARY_CHUNKED)) {
+            entry->chunked = 1;
+            entry->chunks = binary_chunks(binary, record);
+            entry->chunk_count = record->chunk_count;
+            if (entry->chunks == NULL) {
+                fprintf(stderr, "Invalid chunks in %s\n", name);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Read the whole manifest, the restore is done in passes over it.
+static int read_manifest(struct DEDUPE_RESTORE_CONTEXT *context, const char *name) {
+    int ret = map_binary_manifest(name, &context->binary);
+    if (ret < 0)
+        return 1;
+    if (ret == 0) {
+        context->mapped = 1;
+        return read_binary_manifest(context, name);
+    }
+
+    FILE *input_manifest = fopen(name, "rb");
+    if (input_manifest == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", name);
+        return 1;
+    }
 
-        if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
+    char line[PATH_MAX];
+    context->version = 1;
+    if (fgets(line, PATH_MAX, input_manifest) == NULL) {
+        fclose(input_manifest);
+        return 0;
+    }
+    if (sscanf(line, "dedupe\t%d", &context->version) != 1) {
+        fseek(input_manifest, 0, SEEK_SET);
+    }
+    if (context->version > DEDUPE_VERSION) {
+        fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", name);
+        fclose(input_manifest);
+        return 1;
+    }
+
+    ret = 0;
+    while (ret == 0 && fgets(line, PATH_MAX, input_manifest)) {
+        if (strncmp(line, "c\t", 2) == 0) {
+            struct restore_entry *chunked = context->count > 0 ? &context->entries[context->count - 1] : NULL;
+            struct dedupe_binary_chunk *chunks = NULL;
+            int len = -1;
+            if (chunked != NULL && chunked->chunked) {
+                chunks = realloc((void *)chunked->chunks, (chunked->chunk_count + 1) * sizeof(struct dedupe_binary_chunk));
+                if (chunks != NULL) {
+                    chunked->chunks = chunks;
+                    len = parse_digest(line + 2, chunks[chunked->chunk_count].digest);
+                }
+            }
+            if (len < 0) {
+                fprintf(stderr, "Unexpected chunk in %s\n", name);
+                ret = 1;
+                break;
+            }
+            chunks[chunked->chunk_count++].size = strtoull(line + 2 + len + 1, NULL, 10);
             continue;
         }
 
-        array_add(arr, strdup(blob));
+        char type[4];
+        char mode[8];
+        char uid[32];
+        char gid[32];
+        char selabel[PATH_MAX];
+        char at[32];
+        char mt[32];
+        char ct[32];
+        char filename[PATH_MAX];
+        char target[PATH_MAX];
+        char sizeStr[32];
+
+        char *token = line;
+        token = tokenize(type, token, '\t');
+        if (token) token = tokenize(mode, token, '\t');
+        if (token) token = tokenize(uid, token, '\t');
+        if (token) token = tokenize(gid, token, '\t');
+        if (token) token = tokenize(selabel, token, '\t');
+        if (token && context->version >= 2) {
+            token = tokenize(at, token, '\t');
+            if (token) token = tokenize(mt, token, '\t');
+            if (token) token = tokenize(ct, token, '\t');
+        }
+        if (token) token = tokenize(filename, token, '\t');
+        target[0] = '\0';
+        sizeStr[0] = '\0';
+        if (token && (strcmp(type, "f") == 0 || strcmp(type, "l") == 0))
+            token = tokenize(target, token, '\t');
+        if (token && strcmp(type, "f") == 0)
+            token = tokenize(sizeStr, token, '\t');
+        if (token == NULL) {
+            fprintf(stderr, "Invalid entry in %s: %s", name, line);
+            ret = 1;
+            break;
+        }
+        if (strcmp(type, "f") != 0 && strcmp(type, "l") != 0 && strcmp(type, "d") != 0) {
+            fprintf(stderr, "Unknown type %s\n", type);
+            ret = 1;
+            break;
+        }
+
+        struct restore_entry *entry = add_entry(context);
+        if (entry == NULL) {
+            ret = ENOMEM;
+            break;
+        }
+        entry->type = type[0];
+        entry->mode = dec_to_oct(atoi(mode));
+        entry->uid = atoi(uid);
+        entry->gid = atoi(gid);
+        if (context->version >= 2) {
+            entry->atime = atol(at);
+            entry->mtime = atol(mt);
+        }
+        entry->size = atoll(sizeStr);
+        if (entry->type == 'f') {
+            if (strcmp(target, CHUNKED_KEY) == 0) {
+                entry->chunked = 1;
+            } else if (parse_digest(target, entry->digest) < 0) {
+                fprintf(stderr, "Invalid entry in %s: %s", name, line);
+                ret = 1;
+                break;
+            }
+            target[0] = '\0';
+        }
+        entry->selabel = strdup(selabel);
+        entry->filename = strdup(filename);
+        entry->target = strdup(target);
+        if (entry->selabel == NULL || entry->filename == NULL || entry->target == NULL)
+            ret = ENOMEM;
     }
-    closedir(dp);
+    fclose(input_manifest);
+    return ret;
+}
+
+static void* restore_worker(void *cookie) {
+    struct DEDUPE_RESTORE_CONTEXT *context = (struct DEDUPE_RESTORE_CONTEXT *)cookie;
+    while (1) {
+        pthread_mutex_lock(&context->lock);
+        while (context->next < context->count && context->entries[context->next].type != 'f')
+            context->next++;
+        int i = context->next++;
+        pthread_mutex_unlock(&context->lock);
+        if (i >= context->count)
+            break;
+
+        struct restore_entry *entry = &context->entries[i];
+        if (entry->chunked)
+            entry->ret = restore_chunks(context->blob_dir, entry->filename, entry->size, entry->chunks, entry->chunk_count);
+        else
+            entry->ret = restore_blob(context->blob_dir, entry->digest, entry->filename);
+    }
+    return NULL;
+}
+
+static void apply_metadata(struct DEDUPE_RESTORE_CONTEXT *context, struct restore_entry *entry) {
+    if (entry->type == 'l') {
+        // Android has no lchmod, and chmod follows symlinks
+        //chmod(filename, mode_oct);
+        lchown(entry->filename, entry->uid, entry->gid);
+    } else {
+        chown(entry->filename, entry->uid, entry->gid);
+        chmod(entry->filename, entry->mode);
+    }
+    if (lsetfilecon(entry->filename, entry->selabel) < 0) {
+        fprintf(stderr, "Can't setfilecon %s\n", entry->filename);
+    }
+    // utimes follows symlinks too
+    if (context->version >= 2 && entry->type != 'l') {
+        struct timeval times[2];
+        times[0].tv_sec = entry->atime;
+        times[0].tv_usec = 0;
+        times[1].tv_sec = entry->mtime;
+        times[1].tv_usec = 0;
+        utimes(entry->filename, times);
+    }
+}
+
+// Runs "dedupe x" in the current directory: directories first, then the
+// files on jobs threads and the links, and the metadata last so that
+// nothing touches a directory after its mtime was set.
+static int restore(struct DEDUPE_RESTORE_CONTEXT *context, int jobs) {
+    pthread_t workers[MAX_JOBS];
+    int workers_started = 0;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < context->count; i++) {
+        struct restore_entry *entry = &context->entries[i];
+        // writable until the metadata pass
+        if (entry->type == 'd')
+            mkdir(entry->filename, S_IRWXU);
+    }
+
+    pthread_mutex_init(&context->lock, NULL);
+    context->next = 0;
+    for (workers_started = 0; workers_started < jobs; workers_started++) {
+        if (pthread_create(&workers[workers_started], NULL, restore_worker, context))
+            break;
+    }
+    if (workers_started == 0)
+        restore_worker(context);
+
+    for (i = 0; i < context->count; i++) {
+        struct restore_entry *entry = &context->entries[i];
+        printf("%s\n", entry->filename);
+        if (entry->type == 'l')
+            symlink(entry->target, entry->filename);
+    }
+
+    for (i = 0; i < workers_started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&context->lock);
+
+    for (i = 0; i < context->count; i++) {
+        if (context->entries[i].ret) {
+            fprintf(stderr, "Unable to copy file %s\n", context->entries[i].filename);
+            ret = context->entries[i].ret;
+        }
+    }
+    if (ret)
+        return ret;
+
+    for (i = 0; i < context->count; i++) {
+        if (context->entries[i].type != 'd')
+            apply_metadata(context, &context->entries[i]);
+    }
+    // children before their parents
+    for (i = context->count - 1; i >= 0; i--) {
+        if (context->entries[i].type == 'd')
+            apply_metadata(context, &context->entries[i]);
+    }
+    return 0;
 }
 
 static int check_file(const char* f) {
@@ -363,6 +2030,49 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
+        const char *md5_output = NULL;
+        const char *previous_manifest = NULL;
+        unsigned long chunk_min = CHUNK_MIN_SIZE;
+        unsigned long chunk_avg = CHUNK_AVG_SIZE;
+        unsigned long chunk_max = CHUNK_MAX_SIZE;
+        int compress = 0;
+        int binary = 0;
+        int jobs = 1;
+        while (argc >= 3 && argv[2][0] == '-') {
+            // options without an argument
+            if (strcmp(argv[2], "-z") == 0 || strcmp(argv[2], "-b") == 0) {
+                if (argv[2][1] == 'z')
+                    compress = 1;
+                else
+                    binary = 1;
+                argv++;
+                argc--;
+                continue;
+            }
+            if (argc < 4)
+                break;
+            if (strcmp(argv[2], "-m") == 0)
+                md5_output = argv[3];
+            else if (strcmp(argv[2], "-j") == 0)
+                jobs = atoi(argv[3]);
+            else if (strcmp(argv[2], "-p") == 0)
+                previous_manifest = argv[3];
+            else if (strcmp(argv[2], "-s") == 0) {
+                if (sscanf(argv[3], "%lu:%lu:%lu", &chunk_min, &chunk_avg, &chunk_max) != 3 ||
+                        chunk_min == 0 || chunk_min > chunk_avg || chunk_avg > chunk_max) {
+                    fprintf(stderr, "Invalid chunk sizes %s\n", argv[3]);
+                    return 1;
+                }
+            }
+            else
+                break;
+            argv += 2;
+            argc -= 2;
+        }
+        if (jobs < 1)
+            jobs = 1;
+        if (jobs > MAX_JOBS)
+            jobs = MAX_JOBS;
         if (argc < 5) {
             usage(argv);
             return 1;
@@ -381,141 +2091,115 @@ int dedupe_main(int argc, char** argv) {
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
+        memset(&context, 0, sizeof(context));
+        context.output_manifest = fopen(argv[4], binary ? "w+b" : "wb");
         if (context.output_manifest == NULL) {
             fprintf(stderr, "Unable to open output file %s\n", argv[4]);
             return 1;
         }
+        context.binary = binary;
+        if (binary) {
+            char tmp[PATH_MAX];
+            snprintf(tmp, sizeof(tmp), "%s.chunks", argv[4]);
+            context.chunks_file = fopen(tmp, "w+b");
+            unlink(tmp);
+            snprintf(tmp, sizeof(tmp), "%s.strings", argv[4]);
+            context.strings_file = fopen(tmp, "w+b");
+            unlink(tmp);
+            if (context.chunks_file == NULL || context.strings_file == NULL) {
+                fprintf(stderr, "Unable to open temporary files for %s\n", argv[4]);
+                return 1;
+            }
+        }
+        FILE *md5_file = NULL;
+        if (md5_output != NULL && (md5_file = fopen(md5_output, "w")) == NULL) {
+            fprintf(stderr, "Unable to open output file %s\n", md5_output);
+            return 1;
+        }
+        MD5_Init(&context.manifest_md5);
+        context.jobs = jobs;
+        context.cache = NULL;
+        context.compress = compress;
+        // boundaries are where the top log2(avg) bits of the hash are zero
+        int avg_bits = 0;
+        while ((2UL << avg_bits) <= chunk_avg)
+            avg_bits++;
+        context.chunk_min = chunk_min;
+        context.chunk_max = chunk_max;
+        context.chunk_mask = avg_bits > 0 ? ~0ULL << (64 - avg_bits) : 0;
+        init_gear();
+        // a missing or unreadable previous manifest just means rehashing everything
+        if (previous_manifest != NULL)
+            load_cache(&context, previous_manifest);
         mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
         realpath(argv[3], context.blob_dir);
         chdir(argv[2]);
         context.excludes = argv + 5;
         context.exclude_count = argc - 5;
 
-        return store_dir(&context, st, ".");
+        ret = store(&context, st);
+        if (fclose(context.output_manifest) != 0 && ret == 0)
+            ret = 1;
+        if (binary) {
+            fclose(context.chunks_file);
+            fclose(context.strings_file);
+        }
+
+        // md5sum compatible line for the manifest, so callers don't have to read it back
+        if (md5_file != NULL) {
+            if (ret == 0) {
+                unsigned char digest[MD5_DIGEST_LENGTH];
+                MD5_Final(digest, &context.manifest_md5);
+                int j;
+                for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+                    fprintf(md5_file, "%02x", digest[j]);
+                const char *manifest_name = strrchr(argv[4], '/');
+                fprintf(md5_file, "  %s\n", manifest_name != NULL ? manifest_name + 1 : argv[4]);
+            }
+            fclose(md5_file);
+        }
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
+        int jobs = 1;
+        if (argc >= 4 && strcmp(argv[2], "-j") == 0) {
+            jobs = atoi(argv[3]);
+            argv += 2;
+            argc -= 2;
+        }
+        if (jobs < 1)
+            jobs = 1;
+        if (jobs > MAX_JOBS)
+            jobs = MAX_JOBS;
         if (argc != 5) {
             usage(argv);
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
-            return 1;
-        }
-
         char blob_dir[PATH_MAX];
         char *output_dir = argv[4];
         realpath(argv[3], blob_dir);
 
+        struct DEDUPE_RESTORE_CONTEXT context;
+        memset(&context, 0, sizeof(context));
+        context.blob_dir = blob_dir;
+        int ret = read_manifest(&context, argv[2]);
+        if (ret) {
+            free_entries(&context);
+            return ret;
+        }
+
         printf("%s\n" , output_dir);
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            free_entries(&context);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
-        }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char selabel[PATH_MAX];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(selabel, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, selabel, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (lsetfilecon(filename, selabel) < 0) {
-                fprintf(stderr, "Can't setfilecon %s\n", filename);
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
-        }
-
-        fclose(input_manifest);
-        return 0;
+        ret = restore(&context, jobs);
+        free_entries(&context);
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
         if (argc < 3) {
@@ -530,104 +2214,29 @@ int dedupe_main(int argc, char** argv) {
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
+        struct digest_set used;
+        if (digest_set_init(&used, 4096)) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
 
-        char blob[PATH_MAX];
         int i;
-        int failure = 0;
         for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
-                failure = 1;
-                goto out;
-            }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char selabel[PATH_MAX];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                token = tokenize(selabel, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
-        }
-
-        recursive_list_dir(blob_dir, &all_files);
-
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
-
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
-
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
+            if (scan_manifest(argv[i], &used)) {
+                free(used.slots);
+                return 1;
             }
         }
+        // the set is all gc needs, 32 bytes per slot at a load of at least 3/8
+        printf("%lu blobs in use, %lu KB of memory\n", (unsigned long)used.count,
+                (unsigned long)(used.capacity * SHA256_DIGEST_LENGTH / 1024));
 
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
+        int deleted = 0;
+        sweep_blobs(blob_dir, &used, &deleted);
+        printf("%d blobs deleted\n", deleted);
 
-        return failure;
+        free(used.slots);
+        return 0;
     }
     else {
         usage(argv);
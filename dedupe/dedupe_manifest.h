@@ -0,0 +1,54 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <stdint.h>
+
+// Binary manifest, written by "dedupe c -b" in place of the text one.
+// Meant to be mmapped: a header, the fixed size records in walk order, the
+// chunks of chunked files, then a table of NUL terminated strings that the
+// records point into. Offsets are from the start of the file, all fields are
+// little endian and naturally aligned.
+
+#define DEDUPE_BINARY_MAGIC "DEDUPEB"
+#define DEDUPE_BINARY_VERSION 1
+
+// dedupe_binary_record.flags
+#define DEDUPE_BINARY_CHUNKED 1
+
+struct dedupe_binary_header {
+    char magic[8];              // DEDUPE_BINARY_MAGIC
+    uint32_t version;
+    uint32_t record_size;       // sizeof(struct dedupe_binary_record)
+    uint64_t record_count;
+    uint64_t chunk_count;
+    uint64_t records_offset;
+    uint64_t chunks_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct dedupe_binary_record {
+    uint8_t type;               // 'f', 'd' or 'l', as in text manifests
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t mode;              // permission bits, not the decimal-as-octal of text manifests
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint32_t path;              // string table offsets
+    uint32_t selabel;
+    uint32_t target;            // link target
+    uint32_t chunk_count;
+    uint64_t first_chunk;
+    uint8_t digest[32];         // sha256 of the contents, unless chunked
+};
+
+struct dedupe_binary_chunk {
+    uint8_t digest[32];
+    uint64_t size;
+};
+
+#endif
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -42,7 +43,6 @@
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
-#define PUBLIC_KEYS_FILE "/res/keys"
 
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
@@ -185,6 +185,74 @@ else
     return 0;
 }
 
+// try_update_binary() looks for these in the update binary while it is
+// extracted, rather than reading it back afterwards.
+#define SET_PERM_MARKER "set_perm_"
+#define SET_METADATA_MARKER "set_metadata_"
+// enough of the previous chunk to catch a marker split across chunks
+#define MARKER_CARRY (sizeof(SET_METADATA_MARKER) - 2)
+
+struct update_binary_writer {
+    int fd;
+    bool found_set_perm;
+    bool found_set_meta;
+    unsigned char carry[2 * MARKER_CARRY];
+    size_t carry_len;
+};
+
+// Both markers start with "set_", so a single memmem() pass finds the
+// candidates for either.
+static void
+scan_for_markers(struct update_binary_writer* w, const unsigned char* data, size_t len) {
+    const unsigned char* end = data + len;
+    const unsigned char* p = data;
+    while (!(w->found_set_perm && w->found_set_meta) &&
+           (p = memmem(p, end - p, "set_", 4)) != NULL) {
+        size_t left = end - p;
+        if (left >= strlen(SET_PERM_MARKER) &&
+            memcmp(p, SET_PERM_MARKER, strlen(SET_PERM_MARKER)) == 0)
+            w->found_set_perm = true;
+        if (left >= strlen(SET_METADATA_MARKER) &&
+            memcmp(p, SET_METADATA_MARKER, strlen(SET_METADATA_MARKER)) == 0)
+            w->found_set_meta = true;
+        p++;
+    }
+}
+
+static bool
+write_and_scan_update_binary(const unsigned char* data, int dataLen, void* cookie) {
+    struct update_binary_writer* w = (struct update_binary_writer*)cookie;
+
+    ssize_t soFar = 0;
+    while (soFar < dataLen) {
+        ssize_t n = write(w->fd, data + soFar, dataLen - soFar);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        soFar += n;
+    }
+
+    // markers that straddle the previous chunk and this one
+    size_t head = (size_t)dataLen < MARKER_CARRY ? (size_t)dataLen : MARKER_CARRY;
+    memcpy(w->carry + w->carry_len, data, head);
+    scan_for_markers(w, w->carry, w->carry_len + head);
+    scan_for_markers(w, data, dataLen);
+
+    // keep the last MARKER_CARRY bytes for the next chunk
+    if ((size_t)dataLen >= MARKER_CARRY) {
+        memcpy(w->carry, data + dataLen - MARKER_CARRY, MARKER_CARRY);
+        w->carry_len = MARKER_CARRY;
+    } else {
+        w->carry_len += head;
+        if (w->carry_len > MARKER_CARRY) {
+            memmove(w->carry, w->carry + w->carry_len - MARKER_CARRY, MARKER_CARRY);
+            w->carry_len = MARKER_CARRY;
+        }
+    }
+    return true;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -230,19 +298,6 @@ else
 
         return 1;
     }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
-    close(fd);
-
-    if (!ok) {
-if ( language== 1 )
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-else
-        LOGE("无法复制 %s\n", ASSUMED_UPDATE_BINARY_NAME);
-
-        mzCloseZipArchive(zip);
-        return 1;
-    }
-
     /* Make sure the update binary is compatible with this recovery
      *
      * We're building this against 4.4's (or above) bionic, which
@@ -251,47 +306,27 @@ else
      * one. If "set_metadata_" isn't there, it's pre-4.4, which
      * makes it incompatible.
      *
-     * Also, I hate matching strings in binary blobs */
-
-    FILE *updaterfile = fopen(binary, "rb");
-    char tmpbuf;
-    char setpermmatch[9] = { 's','e','t','_','p','e','r','m','_' };
-    char setmetamatch[13] = { 's','e','t','_','m','e','t','a','d','a','t','a','_' };
-    size_t pos = 0;
-    bool foundsetperm = false;
-    bool foundsetmeta = false;
+     * Also, I hate matching strings in binary blobs.  At least they
+     * are matched as the binary is extracted, so it isn't read twice.
+     */
+    struct update_binary_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.fd = fd;
+    bool ok = mzProcessZipEntryContents(zip, binary_entry,
+            write_and_scan_update_binary, &writer);
+    close(fd);
 
-    if (updaterfile == NULL) {
+    if (!ok) {
 if ( language== 1 )
-        LOGE("Can't find %s for validation\n", ASSUMED_UPDATE_BINARY_NAME);
+        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
 else
-        LOGE("无法找到 %s 以进行校验\n", ASSUMED_UPDATE_BINARY_NAME);
+        LOGE("无法复制 %s\n", ASSUMED_UPDATE_BINARY_NAME);
 
+        mzCloseZipArchive(zip);
         return 1;
     }
-    fseek(updaterfile, 0, SEEK_SET);
-    while (!feof(updaterfile)) {
-        fread(&tmpbuf, 1, 1, updaterfile);
-        if (!foundsetperm && pos < sizeof(setpermmatch) && tmpbuf == setpermmatch[pos]) {
-            pos++;
-            if (pos == sizeof(setpermmatch)) {
-                foundsetperm = true;
-                pos = 0;
-            }
-            continue;
-        }
-        if (!foundsetmeta && tmpbuf == setmetamatch[pos]) {
-            pos++;
-            if (pos == sizeof(setmetamatch)) {
-                foundsetmeta = true;
-                pos = 0;
-            }
-            continue;
-        }
-        /* None of the match loops got a continuation, reset the counter */
-        pos = 0;
-    }
-    fclose(updaterfile);
+    bool foundsetperm = writer.found_set_perm;
+    bool foundsetmeta = writer.found_set_meta;
 
     /* Set legacy properties */
     if (foundsetperm && !foundsetmeta) {
@@ -466,7 +501,7 @@ else
 }
 
 static int
-really_install_package(const char *path)
+really_install_package(const char *path, int verified)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
 if ( language== 1 )
@@ -519,7 +554,30 @@ else
 
     int err;
 
-    if (signature_check_enabled) {
+    /* Map the package once.  Verification reads it through the mapping,
+     * which leaves it in the page cache, and the archive then takes the
+     * mapping over instead of reading the file again.  Packages that
+     * can't be mapped whole (over 4GB on 32-bit) are read from the file
+     * instead.
+     */
+    MemMapping map;
+    int fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        err = errno;
+if ( language== 1 )
+        LOGE("Can't open %s\n(%s)\n", path, strerror(err));
+else
+        LOGE("无法打开 %s\n(%s)\n", path, strerror(err));
+
+        return INSTALL_CORRUPT;
+    }
+    if (sysMapFileInShmem(fd, &map) != 0) {
+        LOGI("Can't map %s, reading it instead\n", path);
+        close(fd);
+        fd = -1;
+    }
+
+    if (signature_check_enabled && !verified) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
@@ -528,6 +586,10 @@ if ( language== 1 )
 else
             LOGE("无法载入密钥\n");
 
+            if (fd >= 0) {
+                sysReleaseShmem(&map);
+                close(fd);
+            }
             return INSTALL_CORRUPT;
         }
 if ( language== 1 )
@@ -546,7 +608,10 @@ else
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        if (fd >= 0)
+            err = verify_mapped_file(map.addr, map.length, loadedKeys, numKeys);
+        else
+            err = verify_file(path, loadedKeys, numKeys);
         free(loadedKeys);
 if ( language== 1 )
         LOGI("verify_file returned %d\n", err);
@@ -560,27 +625,39 @@ else
             LOGE("签名校验失败\n");
 
             ui_show_text(1);
-if ( language== 1 ) {
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
-		return INSTALL_CORRUPT;
-}else{
-            if (!confirm_selection("刷入不信任的刷机包？", "是 - 刷入不信任的刷机包"))
+            int install;
+if ( language== 1 )
+            install = confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip");
+else
+            install = confirm_selection("刷入不信任的刷机包？", "是 - 刷入不信任的刷机包");
 
+            if (!install) {
+                if (fd >= 0) {
+                    sysReleaseShmem(&map);
+                    close(fd);
+                }
                 return INSTALL_CORRUPT;
-	}
+            }
        }
     }
 
     /* Try to open the package.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    if (fd >= 0)
+        err = mzOpenZipArchiveMapped(fd, &map, &zip);
+    else
+        err = mzOpenZipArchive(path, &zip);
     if (err != 0) {
 if ( language== 1 )
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
 else
         LOGE("无法打开 %s\n(%s)\n", path, err != -1 ? strerror(err) : "已损坏");
 
+        if (fd >= 0) {
+            sysReleaseShmem(&map);
+            close(fd);
+        }
         return INSTALL_CORRUPT;
     }
 
@@ -594,8 +671,8 @@ else
     return try_update_binary(path, &zip);
 }
 
-int
-install_package(const char* path)
+static int
+log_and_install_package(const char* path, int verified)
 {
     FILE* install_log = fopen_path(LAST_INSTALL_FILE, "w");
     if (install_log) {
@@ -608,7 +685,7 @@ else
         LOGE("无法打开 last_install: %s\n", strerror(errno));
 
     }
-    int result = really_install_package(path);
+    int result = really_install_package(path, verified);
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
@@ -617,3 +694,15 @@ else
     }
     return result;
 }
+
+int
+install_package(const char* path)
+{
+    return log_and_install_package(path, 0);
+}
+
+int
+install_verified_package(const char* path)
+{
+    return log_and_install_package(path, 1);
+}
@@ -22,4 +22,10 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+// Like install_package(), for a package whose signature the caller has
+// already checked against PUBLIC_KEYS_FILE.
+int install_verified_package(const char *root_path);
+
+#define PUBLIC_KEYS_FILE "/res/keys"
+
 #endif  // RECOVERY_INSTALL_H_
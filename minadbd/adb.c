@@ -309,6 +309,7 @@ void handle_packet(apacket *p, atransport *t)
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
+        t->max_payload = p->msg.arg1 < MAX_PAYLOAD ? p->msg.arg1 : MAX_PAYLOAD;
         parse_banner((char*) p->data, t);
         handle_online();
         if(!HOST) send_connect(t);
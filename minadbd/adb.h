@@ -22,7 +22,12 @@
 #include "transport.h"  /* readx(), writex() */
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+/* Hosts send and accept at most MAX_PAYLOAD_V1 unless their CONNECT
+** says otherwise.  Larger payloads mean fewer WRITE/OKAY round trips
+** for sideload.
+*/
+#define MAX_PAYLOAD_V1 4096
+#define MAX_PAYLOAD (64*1024)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -187,6 +192,9 @@ struct atransport
     char *product;
     int adb_port; // Use for emulators (local transport)
 
+        /* largest payload the other end accepts, from its CONNECT */
+    size_t max_payload;
+
         /* a list of adisconnect callbacks called when the transport is kicked */
     int          kicked;
     adisconnect  disconnects;
@@ -204,6 +212,7 @@ void close_all_sockets(atransport *t);
 
 asocket *create_local_socket(int fd);
 asocket *create_local_service_socket(const char *destination);
+asocket *create_sideload_socket(unsigned count);
 
 asocket *create_remote_socket(unsigned id, atransport *t);
 void connect_to_remote(asocket *s, const char *destination);
@@ -43,41 +43,104 @@ void *service_bootstrap_func(void *x)
     return 0;
 }
 
-static void sideload_service(int s, void *cookie)
+/* The sideload service is a local socket bound to the package file:
+** packets are written to it straight from the transport, on the event
+** loop thread, rather than through a socketpair to a service thread.
+** It is the only service this adbd runs, so blocking the loop on the
+** file write costs nothing.  s->extra counts the bytes still to come.
+*/
+static void *sideload_exit_thread(void *x)
 {
-    unsigned char buf[4096];
-    unsigned count = (unsigned) cookie;
-    int fd;
+    /* give the event loop time to send OKAY and close */
+    sleep(1);
+    exit(0);
+    return 0;
+}
 
-    fprintf(stderr, "sideload_service invoked\n");
+static void sideload_reply(asocket *s, const char *reply)
+{
+    if(s->peer == 0) return;
+    apacket *p = get_apacket();
+    memcpy(p->data, reply, 4);
+    p->len = 4;
+    s->peer->enqueue(s->peer, p);
+}
 
-    fd = adb_creat(ADB_SIDELOAD_FILENAME, 0644);
-    if(fd < 0) {
-        fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_FILENAME);
-        adb_close(s);
-        return;
+static int sideload_enqueue(asocket *s, apacket *p)
+{
+    unsigned count = (uintptr_t) s->extra;
+    unsigned len = p->len > count ? count : p->len;
+
+    if(writex(s->fd, p->data, len)) {
+        fprintf(stderr, "failed to write %s\n", ADB_SIDELOAD_FILENAME);
+        put_apacket(p);
+        sideload_reply(s, "FAIL");
+        s->close(s);
+        return 1;
     }
+    put_apacket(p);
+    count -= len;
+    s->extra = (void*) (uintptr_t) count;
+    if(count > 0) return 0;
+
+    sideload_reply(s, "OKAY");
+    s->close(s);
 
-    while(count > 0) {
-        unsigned xfer = (count > 4096) ? 4096 : count;
-        if(readx(s, buf, xfer)) break;
-        if(writex(fd, buf, xfer)) break;
-        count -= xfer;
+    fprintf(stderr, "adbd exiting after successful sideload\n");
+    adb_thread_t t;
+    if(adb_thread_create(&t, sideload_exit_thread, 0)) {
+        exit(0);
     }
+    return 1;
+}
+
+static void sideload_ready(asocket *s)
+{
+    /* nothing to read: the file is written, never read */
+}
 
-    if(count == 0) {
-        writex(s, "OKAY", 4);
-    } else {
-        writex(s, "FAIL", 4);
+/* Only one sideload at a time, each to a file of its own: recovery hashes
+** the package while it arrives and must not see it rewritten under it.
+*/
+static int sideload_active = 0;
+static void (*sideload_socket_close)(asocket *s);
+
+static void sideload_close(asocket *s)
+{
+    sideload_active = 0;
+    sideload_socket_close(s);
+}
+
+asocket *create_sideload_socket(unsigned count)
+{
+    asocket *s;
+    int fd;
+
+    fprintf(stderr, "sideload_service invoked\n");
+
+    if(sideload_active) {
+        fprintf(stderr, "refusing sideload while another is in progress\n");
+        return 0;
     }
-    adb_close(fd);
-    adb_close(s);
 
-    if (count == 0) {
-        fprintf(stderr, "adbd exiting after successful sideload\n");
-        sleep(1);
-        exit(0);
+    adb_unlink(ADB_SIDELOAD_FILENAME);
+    fd = adb_open_mode(ADB_SIDELOAD_FILENAME,
+                       O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_FILENAME);
+        return 0;
     }
+    close_on_exec(fd);
+
+    s = create_local_socket(fd);
+    s->enqueue = sideload_enqueue;
+    s->ready = sideload_ready;
+    sideload_socket_close = s->close;
+    s->close = sideload_close;
+    sideload_active = 1;
+    s->extra = (void*) (uintptr_t) count;
+    D("LS(%d): bound to sideload of %u bytes via %d\n", s->id, count, fd);
+    return s;
 }
 
 
@@ -113,7 +176,6 @@ static void echo_service(int fd, void *cookie)
 done:
     close(fd);
 }
-#endif
 
 static int create_service_thread(void (*func)(int, void *), void *cookie)
 {
@@ -143,18 +205,17 @@ static int create_service_thread(void (*func)(int, void *), void *cookie)
     D("service thread started, %d:%d\n",s[0], s[1]);
     return s[0];
 }
+#endif
 
 int service_to_fd(const char *name)
 {
     int ret = -1;
 
-    if (!strncmp(name, "sideload:", 9)) {
-        ret = create_service_thread(sideload_service, (void*) atoi(name + 9));
 #if 0
-    } else if(!strncmp(name, "echo:", 5)){
+    if(!strncmp(name, "echo:", 5)){
         ret = create_service_thread(echo_service, 0);
-#endif
     }
+#endif
     if (ret >= 0) {
         close_on_exec(ret);
     }
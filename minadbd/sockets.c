@@ -313,10 +313,18 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
     if(ev & FDE_READ){
         apacket *p = get_apacket();
         unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        size_t max_payload = MAX_PAYLOAD;
+        size_t avail;
         int r;
         int is_eof = 0;
 
+            /* no more than the host said it can take */
+        if(s->peer && s->peer->transport &&
+           s->peer->transport->max_payload < max_payload) {
+            max_payload = s->peer->transport->max_payload;
+        }
+        avail = max_payload;
+
         while(avail > 0) {
             r = adb_read(fd, x, avail);
             D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%d\n", s->id, s->fd, r, r<0?errno:0, avail);
@@ -336,10 +344,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == max_payload) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = max_payload - avail;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -405,6 +413,10 @@ asocket *create_local_service_socket(const char *name)
     asocket *s;
     int fd;
 
+    if(!strncmp(name, "sideload:", 9)) {
+        return create_sideload_socket(strtoul(name + 9, 0, 10));
+    }
+
     fd = service_to_fd(name);
     if(fd < 0) return 0;
 
@@ -116,6 +116,7 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->connection_state = state;
     t->type = kTransportUsb;
     t->usb = h;
+    t->max_payload = MAX_PAYLOAD_V1;
 
     HOST = 0;
 }
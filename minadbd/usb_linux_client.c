@@ -94,16 +94,25 @@ int usb_write(usb_handle *h, const void *data, int len)
     return 0;
 }
 
+/* The f_adb driver fails reads larger than its bulk request buffer, so
+** payloads over MAX_PAYLOAD_V1 are read a request at a time.
+*/
 int usb_read(usb_handle *h, void *data, int len)
 {
+    char *p = data;
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+    while(len > 0) {
+        int xfer = (len > MAX_PAYLOAD_V1) ? MAX_PAYLOAD_V1 : len;
+        n = adb_read(h->fd, p, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        p += xfer;
+        len -= xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -3,14 +3,15 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -23,8 +24,6 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -50,6 +49,7 @@ enum {
 
     ENDSIG = 0x06054b50,     // PK56
     ENDHDR = 22,
+    ENDMAXCOM = 0xffff,      // longest archive comment
 
     ENDSUB =  8,
     ENDTOT = 10,
@@ -57,6 +57,22 @@ enum {
     ENDOFF = 16,
     ENDCOM = 20,
 
+    ZIP64_ENDSIG = 0x06064b50,   // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDSUB = 24,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDSIZ = 40,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_LOCSIG = 0x07064b50,   // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_EXTID = 0x0001,        // ZIP64 extended information extra field
+    ZIP64_MAGIC32 = 0xffffffff,  // a 32-bit field that is in the extra field
+
     EXTSIG = 0x08074b50,     // PK78
     EXTHDR = 16,
 
@@ -91,70 +107,100 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   off=%lld comp=%lld uncomp=%lld how=%d\n", pEntry->offset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Compare an entry's name with "name", which is "nameLen" bytes long.
+ * Names are ordered byte by byte, a name sorting before any longer name
+ * it is a prefix of; all the names beginning with a given prefix are
+ * therefore next to each other.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareEntryName(const ZipEntry* pEntry, const char* name,
+        unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    unsigned int len = pEntry->fileNameLen < nameLen ?
+            pEntry->fileNameLen : nameLen;
+    int diff = memcmp(pEntry->fileName, name, len);
+    if (diff != 0)
+        return diff;
+    if (pEntry->fileNameLen == nameLen)
+        return 0;
+    return pEntry->fileNameLen < nameLen ? -1 : 1;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Sort the entries by name.  This is a merge sort, so entries with the
+ * same name stay in central directory order and lookups find the first
+ * one, and it takes O(n log n) however the archive was written.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static bool sortEntries(ZipEntry* pEntries, unsigned int numEntries)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    ZipEntry* from = pEntries;
+    ZipEntry* to;
+    unsigned int width;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
-}
-
-/*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
- */
-static unsigned int computeHash(const char* name, int nameLen)
-{
-    unsigned int hash = 2;
+    if (numEntries < 2)
+        return true;
+    to = (ZipEntry*) malloc(numEntries * sizeof(ZipEntry));
+    if (to == NULL)
+        return false;
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    for (width = 1; width < numEntries; width *= 2) {
+        unsigned int start;
+        for (start = 0; start < numEntries; start += 2 * width) {
+            unsigned int mid = start + width < numEntries ?
+                    start + width : numEntries;
+            unsigned int end = mid + width < numEntries ?
+                    mid + width : numEntries;
+            unsigned int left = start, right = mid, out = start;
+
+            while (left < mid && right < end) {
+                if (compareEntryName(&from[right], from[left].fileName,
+                        from[left].fileNameLen) < 0)
+                    to[out++] = from[right++];
+                else
+                    to[out++] = from[left++];
+            }
+            memcpy(to + out, from + left, (mid - left) * sizeof(ZipEntry));
+            out += mid - left;
+            memcpy(to + out, from + right, (end - right) * sizeof(ZipEntry));
+        }
+        ZipEntry* tmp = from;
+        from = to;
+        to = tmp;
+    }
 
-    return hash;
+    if (from != pEntries) {
+        memcpy(pEntries, from, numEntries * sizeof(ZipEntry));
+        free(from);
+    } else {
+        free(to);
+    }
+    return true;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Return the index of the first entry whose name doesn't sort before
+ * "name", or numEntries if there is none.  With a directory prefix, this
+ * is the first entry in that directory, if it has any.
+ */
+static unsigned int findFirstEntry(const ZipArchive* pArchive,
+        const char* name, unsigned int nameLen)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (compareEntryName(&pArchive->pEntries[mid], name, nameLen) < 0)
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,18 +223,135 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Copy "len" bytes at "offset" in the archive file to "buf", through the
+ * mapping if the whole file is mapped.
+ */
+static bool readArchive(const ZipArchive* pArchive, long long offset,
+    void* buf, size_t len)
+{
+    if (offset < 0 || offset > pArchive->length ||
+            (unsigned long long)len > (unsigned long long)(pArchive->length - offset)) {
+        LOGW("Read of %zu bytes at %lld is past the end (len=%lld)\n",
+            len, offset, pArchive->length);
+        return false;
+    }
+    if (pArchive->map.addr != NULL) {
+        memcpy(buf, (const unsigned char*) pArchive->map.addr + offset, len);
+        return true;
+    }
+
+    unsigned char* p = (unsigned char*) buf;
+    while (len > 0) {
+        ssize_t n = pread64(pArchive->fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGW("Can't read %zu bytes at %lld: %s\n", len, offset,
+                n < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+ * Return the "len" bytes at "offset" in the archive file.  That is a
+ * pointer into the mapping, or a copy in "*pCopy" that the caller frees.
+ */
+static const unsigned char* archiveRegion(const ZipArchive* pArchive,
+    long long offset, size_t len, unsigned char** pCopy)
+{
+    *pCopy = NULL;
+    if (pArchive->map.addr != NULL) {
+        if (offset < 0 || offset > pArchive->length ||
+                (unsigned long long)len > (unsigned long long)(pArchive->length - offset))
+            return NULL;
+        return (const unsigned char*) pArchive->map.addr + offset;
+    }
+
+    *pCopy = (unsigned char*) malloc(len > 0 ? len : 1);
+    if (*pCopy == NULL) {
+        LOGE("Can't allocate %zu bytes for zip data\n", len);
+        return NULL;
+    }
+    if (!readArchive(pArchive, offset, *pCopy, len)) {
+        free(*pCopy);
+        *pCopy = NULL;
+        return NULL;
+    }
+    return *pCopy;
+}
+
+/*
+ * Fill in the fields of a central directory entry that were too large
+ * for it from its ZIP64 extended information extra field.  Only the
+ * fields set to ZIP64_MAGIC32 are stored there, in this order.
+ *
+ * Returns "true" on success.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    unsigned long long* uncompLen, unsigned long long* compLen,
+    unsigned long long* localHdrOffset)
+{
+    unsigned long long* fields[3] = { uncompLen, compLen, localHdrOffset };
+
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+        if (size > extraLen - 4)
+            return false;
+        if (id == ZIP64_EXTID) {
+            const unsigned char* p = extra + 4;
+            int j;
+            for (j = 0; j < 3; j++) {
+                if (*fields[j] != ZIP64_MAGIC32)
+                    continue;
+                if (p + 8 > extra + 4 + size)
+                    return false;
+                *fields[j] = get8LE(p);
+                p += 8;
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return false;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
  * store it in a hash table.
  *
+ * Archives with more than 65535 entries, or with anything past 4GB, are
+ * described by a ZIP64 end of central directory record and per-entry
+ * ZIP64 extra fields.
+ *
+ * "pArchive" must have its fd, length and (if the file is mapped) map set.
+ * When the file is not mapped, a copy of the central directory is kept
+ * in pArchive->directory for the entry names to point into.
+ *
  * Returns "true" on success.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool parseZipArchive(ZipArchive* pArchive)
 {
     bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    const unsigned char* tail;
+    unsigned char* tailCopy = NULL;
+    const unsigned char* cd;
+    const unsigned char* cdEnd;
+    unsigned char* cdCopy = NULL;
+    unsigned char buf[LOCHDR];
+    unsigned int i, numEntries;
+    unsigned long long totalEntries, cdOffset;
+    long long eocdOffset;
+    size_t tailLen, cdLen;
     unsigned int val;
 
     /*
@@ -196,7 +359,9 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (!readArchive(pArchive, 0, buf, 4))
+        goto bail;
+    val = get4LE(buf);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,52 +372,91 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment.  It can be no further from the end than the longest
+     * comment, and a ZIP64 locator may sit right in front of it.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    tailLen = ENDMAXCOM + ENDHDR + ZIP64_LOCHDR;
+    if ((long long)tailLen > pArchive->length)
+        tailLen = pArchive->length;
+    tail = archiveRegion(pArchive, pArchive->length - tailLen, tailLen,
+            &tailCopy);
+    if (tail == NULL)
+        goto bail;
+    ptr = tail + tailLen - ENDHDR;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    while (ptr >= tail) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < tail) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
+    eocdOffset = pArchive->length - tailLen + (ptr - tail);
 
     /*
      * There are two interesting items in the EOCD block: the number of
      * entries in the file, and the file offset of the start of the
-     * central directory.
+     * central directory.  If either was too large for it, the ZIP64 end
+     * record that the locator points to has the real values.
      */
-    numEntries = get2LE(ptr + ENDSUB);
+    totalEntries = get2LE(ptr + ENDSUB);
     cdOffset = get4LE(ptr + ENDOFF);
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    if (ptr - tail >= ZIP64_LOCHDR &&
+            get4LE(ptr - ZIP64_LOCHDR) == ZIP64_LOCSIG) {
+        unsigned char end64[ZIP64_ENDHDR];
+        unsigned long long end64Offset =
+                get8LE(ptr - ZIP64_LOCHDR + ZIP64_LOCOFF);
+
+        if (end64Offset > (unsigned long long)eocdOffset ||
+                !readArchive(pArchive, end64Offset, end64, sizeof(end64)) ||
+                get4LE(end64) != ZIP64_ENDSIG) {
+            LOGW("Bad ZIP64 end of central directory at %llu\n", end64Offset);
+            goto bail;
+        }
+        totalEntries = get8LE(end64 + ZIP64_ENDSUB);
+        cdOffset = get8LE(end64 + ZIP64_ENDOFF);
+        eocdOffset = end64Offset;
+    }
+
+    /*
+     * The central directory runs up to the end record(s).  Every entry
+     * takes at least CENHDR bytes of it.
+     */
+    LOGVV("numEntries=%llu cdOffset=%llu\n", totalEntries, cdOffset);
+    if (totalEntries == 0 || cdOffset >= (unsigned long long)eocdOffset ||
+            totalEntries > (eocdOffset - cdOffset) / CENHDR ||
+            (unsigned long long)(eocdOffset - cdOffset) > SIZE_MAX) {
+        LOGW("Invalid entries=%llu offset=%llu (len=%lld)\n",
+            totalEntries, cdOffset, pArchive->length);
         goto bail;
     }
+    numEntries = totalEntries;
+    cdLen = eocdOffset - cdOffset;
+
+    cd = archiveRegion(pArchive, cdOffset, cdLen, &cdCopy);
+    if (cd == NULL)
+        goto bail;
+    cdEnd = cd + cdLen;
 
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = cd;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long compLen, uncompLen, localHdrOffset;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > cdEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -266,7 +470,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if (fileName + fileNameLen + extraLen > (const char*)cdEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -275,67 +479,35 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
+        if ((compLen == ZIP64_MAGIC32 || uncompLen == ZIP64_MAGIC32 ||
+                localHdrOffset == ZIP64_MAGIC32) &&
+            !parseZip64Extra((const unsigned char*)fileName + fileNameLen,
+                extraLen, &uncompLen, &compLen, &localHdrOffset))
+        {
+            LOGW("Bad ZIP64 extra field (at %d)\n", i);
+            goto bail;
+        }
+        if (compLen > (unsigned long long)pArchive->length ||
+                uncompLen > LLONG_MAX) {
+            LOGW("Bad entry size (at %d)\n", i);
+            goto bail;
         }
-#else
+
+        /* Entries are read in central directory order and sorted once
+         * they are all in.
+         */
         pEntry = &pArchive->pEntries[i];
-#endif
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+        //LOGI("%d: localHdr=%llu fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,67 +524,78 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        // localHdrOffset is untrusted; readArchive() checks the bounds.
+        if (localHdrOffset > (unsigned long long)pArchive->length ||
+                !readArchive(pArchive, localHdrOffset, buf, LOCHDR)) {
+            LOGW("Bad offset to local header: %llu (at %d)\n",
+                    localHdrOffset, i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
+        if (get4LE(buf) != LOCSIG) {
             LOGW("Missed a local header sig (at %d)\n", i);
             goto bail;
         }
         pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+            + get2LE(buf + LOCNAM) + get2LE(buf + LOCEXT);
+        if (pEntry->offset > pArchive->length ||
+                pEntry->compLen > pArchive->length - pEntry->offset) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
-     */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+    if (!sortEntries(pArchive->pEntries, numEntries))
+        goto bail;
+    for (i = 1; i < numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        if (compareEntryName(pEntry - 1, pEntry->fileName,
+                pEntry->fileNameLen) == 0)
+        {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+        }
     }
-#endif
 
     result = true;
+    pArchive->directory = cdCopy;
+    cdCopy = NULL;
 
 bail:
-    if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
-    }
+    free(tailCopy);
+    free(cdCopy);
     return result;
 }
 
+/*
+ * Parse the archive in "fd", which is "length" bytes long and mapped by
+ * "pMap" if that is non-NULL.  On failure, "pArchive" is left closed but
+ * the fd and mapping are not released.
+ */
+static int openArchive(int fd, const MemMapping* pMap, long long length,
+    ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = fd;
+    pArchive->length = length;
+    if (pMap != NULL)
+        sysCopyMap(&pArchive->map, pMap);
+
+    if (length < ENDHDR) {
+        LOGV("File too small to be zip (%lld)\n", length);
+    } else if (parseZipArchive(pArchive)) {
+        return 0;
+    }
+
+    pArchive->fd = -1;
+    pArchive->map.addr = NULL;
+    mzCloseZipArchive(pArchive);
+    return -1;
+}
+
 /*
  * Open a Zip archive and scan out the contents.
  *
@@ -421,6 +604,10 @@ bail:
  * a relatively small bit at the end, we should end up only touching a
  * small set of pages.
  *
+ * Archives too large to map (anything over 2GB on 32-bit builds, where
+ * even lseek() can't reach the end) are read with pread64() instead, and
+ * only the central directory is kept in memory.
+ *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
  * flag?)
@@ -430,50 +617,65 @@ bail:
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
     MemMapping map;
+    int fd;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
     map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
+    fd = open(fileName, O_RDONLY | O_LARGEFILE, 0);
+    if (fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
-        goto bail;
-    }
-
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
+    if (sysMapFileInShmem(fd, &map) == 0) {
+        err = openArchive(fd, &map, map.length, pArchive);
+    } else {
+        long long length = lseek64(fd, 0, SEEK_END);
+        if (length < 0) {
+            err = errno ? errno : -1;
+            LOGW("Can't find the length of '%s': %s\n",
+                fileName, strerror(err));
+            goto bail;
+        }
+        LOGI("Map of '%s' failed, reading it instead\n", fileName);
+        map.addr = NULL;
+        err = openArchive(fd, NULL, length, pArchive);
     }
-
-    if (!parseZipArchive(pArchive, &map)) {
+    if (err != 0) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
-    err = 0;
-    sysCopyMap(&pArchive->map, &map);
+    fd = -1;
     map.addr = NULL;
 
 bail:
-    if (err != 0)
-        mzCloseZipArchive(pArchive);
+    if (fd >= 0)
+        close(fd);
     if (map.addr != NULL)
         sysReleaseShmem(&map);
     return err;
 }
 
+/*
+ * Open a Zip archive from a file that is already mapped.
+ *
+ * This lets a caller that has read the whole file through the mapping
+ * (to verify its signature, say) parse it without mapping it again.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap,
+        ZipArchive* pArchive)
+{
+    return openArchive(fd, pMap, pMap->length, pArchive);
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -489,12 +691,11 @@ void mzCloseZipArchive(ZipArchive* pArchive)
         sysReleaseShmem(&pArchive->map);
 
     free(pArchive->pEntries);
-
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->directory);
 
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
+    pArchive->directory = NULL;
 }
 
 /*
@@ -505,10 +706,13 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int i = findFirstEntry(pArchive, entryName, nameLen);
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+    if (i < pArchive->numEntries &&
+            compareEntryName(&pArchive->pEntries[i], entryName, nameLen) == 0)
+        return &pArchive->pEntries[i];
+    return NULL;
 }
 
 /*
@@ -523,48 +727,150 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
 }
 
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * If the archive is mapped, the data is handed over straight from the
+ * mapping, in one span unless it is too long for an int.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
+    if (pArchive->map.addr == NULL) {
         unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        long long offset = pEntry->offset;
+        long long bytesLeft = pEntry->compLen;
+        while (bytesLeft > 0) {
+            size_t count = bytesLeft > (long long)sizeof(buf) ?
+                    sizeof(buf) : (size_t)bytesLeft;
+            if (!readArchive(pArchive, offset, buf, count) ||
+                    !processFunction(buf, count, cookie)) {
+                return false;
+            }
+            offset += count;
+            bytesLeft -= count;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
+        return true;
+    }
+
+    const unsigned char *data =
+            (const unsigned char *)pArchive->map.addr + pEntry->offset;
+    size_t bytesLeft = pEntry->compLen;
+    while (bytesLeft > 0) {
+        size_t count = bytesLeft;
+        if (count > INT_MAX) {
+            count = INT_MAX;
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        if (!processFunction(data, count, cookie)) {
             return false;
         }
+        data += count;
         bytesLeft -= count;
     }
     return true;
 }
 
+/* Largest piece of the mapping handed to zlib at once (avail_in is a uInt).
+ */
+#define INFLATE_MAX_SPAN (1U << 30)
+
+/* Inflate a DEFLATED entry through procBuf.  zlib reads straight from the
+ * archive mapping, or from readBuf if the archive isn't mapped.
+ * "zstream" must have been set up with inflateInit2(-MAX_WBITS) and not
+ * used since, or reset.
+ *
+ * Returns the number of bytes produced, or -1 if an error was shown.
+ */
+static long long inflateEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, z_stream *zstream,
+    unsigned char *readBuf, size_t readBufLen,
+    unsigned char *procBuf, size_t procBufLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    long long offset = pEntry->offset;
+    long long compRemaining = pEntry->compLen;
+    long long produced = 0;
+    int zerr;
+
+    zstream->next_in = NULL;
+    zstream->avail_in = 0;
+    zstream->next_out = (Bytef*) procBuf;
+    zstream->avail_out = procBufLen;
+
+    /*
+     * Loop while we have data.
+     */
+    do {
+        /* Feed zlib the next piece of the entry.  parseZipArchive()
+         * checked that all of it lies inside the file.
+         */
+        if (zstream->avail_in == 0 && compRemaining > 0) {
+            size_t getSize;
+            if (pArchive->map.addr != NULL) {
+                getSize = compRemaining > INFLATE_MAX_SPAN ?
+                        INFLATE_MAX_SPAN : (size_t)compRemaining;
+                zstream->next_in =
+                        (Bytef*) pArchive->map.addr + offset;
+            } else {
+                getSize = compRemaining > (long long)readBufLen ?
+                        readBufLen : (size_t)compRemaining;
+                LOGVV("+++ reading %zu bytes (%lld left)\n",
+                    getSize, compRemaining);
+                if (!readArchive(pArchive, offset, readBuf, getSize)) {
+                    return -1;
+                }
+                zstream->next_in = readBuf;
+            }
+            zstream->avail_in = getSize;
+            offset += getSize;
+            compRemaining -= getSize;
+        }
+
+        /* uncompress the data */
+        zerr = inflate(zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            return -1;
+        }
+        if (zerr == Z_OK && zstream->avail_in == 0 && compRemaining == 0 &&
+                zstream->avail_out != 0) {
+            LOGW("inflate ran out of input for '%.*s'\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            return -1;
+        }
+
+        /* write when we're full or when we're done */
+        if (zstream->avail_out == 0 ||
+            (zerr == Z_STREAM_END && zstream->avail_out != procBufLen))
+        {
+            long procSize = zstream->next_out - procBuf;
+            LOGVV("+++ processing %d bytes\n", (int) procSize);
+            bool ret = processFunction(procBuf, procSize, cookie);
+            if (!ret) {
+                LOGW("Process function elected to fail (in inflate)\n");
+                return -1;
+            }
+            produced += procSize;
+
+            zstream->next_out = procBuf;
+            zstream->avail_out = procBufLen;
+        }
+    } while (zerr == Z_OK);
+
+    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
+
+    /* zstream->total_out is only a uLong */
+    return produced;
+}
+
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
+    long long result = -1;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
 
     /*
      * Initialize the zlib stream.
@@ -575,8 +881,6 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     zstream.opaque = Z_NULL;
     zstream.next_in = NULL;
     zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
     zstream.data_type = Z_UNKNOWN;
 
     /*
@@ -594,65 +898,16 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         goto bail;
     }
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
-        }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
+    result = inflateEntry(pArchive, pEntry, &zstream,
+            readBuf, sizeof(readBuf), procBuf, sizeof(procBuf),
+            processFunction, cookie);
 
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
-        }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
-
-    // success!
-    result = zstream.total_out;
-
-z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
                 result, pEntry->uncompLen);
         return false;
     }
@@ -674,13 +929,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +943,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -812,7 +1058,7 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    long long len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -907,6 +1153,241 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/*
+ * Parallel extraction support for mzExtractRecursive().
+ *
+ * The caller walks the entries in order, creating directories and opening
+ * each target file with its selabel context, and queues the open fd here.
+ * Each worker owns its buffers and a zlib stream, and inflates straight
+ * from the archive mapping (or with pread64() if the archive is too
+ * large to map), so the workers never share a file offset.
+ */
+#define EXTRACT_MAX_WORKERS 8
+#define EXTRACT_MAX_PENDING 64
+#define EXTRACT_BUF_SIZE (128 * 1024)
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int fd;
+} ExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;
+    pthread_cond_t jobTaken;
+    ExtractJob jobs[EXTRACT_MAX_PENDING];
+    int head;
+    int count;
+    bool done;
+    bool failed;
+} ExtractPool;
+
+typedef struct {
+    ExtractPool *pool;
+    pthread_t thread;
+    z_stream zstream;
+    unsigned char *readBuf;     // only used if the archive isn't mapped
+    unsigned char *procBuf;
+} ExtractWorker;
+
+/* Uncompress "pEntry" to "fd" using only the worker's own state.
+ */
+static bool extractEntryAt(ExtractWorker *worker, const ZipEntry *pEntry,
+        int fd)
+{
+    const ZipArchive *pArchive = worker->pool->pArchive;
+
+    if (pEntry->compression == STORED) {
+        return processStoredEntry(pArchive, pEntry, writeProcessFunction,
+                (void*)fd);
+    }
+    if (pEntry->compression != DEFLATED) {
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    int zerr = inflateReset(&worker->zstream);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateReset failed (zerr=%d)\n", zerr);
+        return false;
+    }
+    long long result = inflateEntry(pArchive, pEntry, &worker->zstream,
+            worker->readBuf, EXTRACT_BUF_SIZE,
+            worker->procBuf, EXTRACT_BUF_SIZE, writeProcessFunction,
+            (void*)fd);
+    if (result != pEntry->uncompLen) {
+        if (result != -1)
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                    result, pEntry->uncompLen);
+        return false;
+    }
+    return true;
+}
+
+static void *extractWorkerThread(void *arg)
+{
+    ExtractWorker *worker = (ExtractWorker *)arg;
+    ExtractPool *pool = worker->pool;
+
+    while (true) {
+        ExtractJob job;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->done)
+            pthread_cond_wait(&pool->jobReady, &pool->lock);
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % EXTRACT_MAX_PENDING;
+        pool->count--;
+        pthread_cond_signal(&pool->jobTaken);
+        bool skip = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = !skip && extractEntryAt(worker, job.pEntry, job.fd);
+        if (close(job.fd) != 0)
+            ok = false;
+        if (!ok) {
+            if (!skip)
+                LOGE("Error extracting \"%s\"\n", job.targetFile);
+        } else if (pool->timestamp != NULL &&
+                utime(job.targetFile, pool->timestamp)) {
+            LOGE("Error touching \"%s\"\n", job.targetFile);
+            ok = false;
+        } else {
+            LOGD("Extracted file \"%s\"\n", job.targetFile);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok)
+            pool->failed = true;
+        else if (pool->callback != NULL)
+            pool->callback(job.targetFile, pool->cookie);
+        pthread_mutex_unlock(&pool->lock);
+        free(job.targetFile);
+    }
+    return NULL;
+}
+
+/* Queue an opened target file; blocks while the queue is full.
+ * Takes ownership of fd.  Returns false once any job has failed.
+ */
+static bool extractPoolAdd(ExtractPool *pool, const ZipEntry *pEntry,
+        const char *targetFile, int fd)
+{
+    char *name = strdup(targetFile);
+    if (name == NULL) {
+        close(fd);
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == EXTRACT_MAX_PENDING && !pool->failed)
+        pthread_cond_wait(&pool->jobTaken, &pool->lock);
+    bool ok = !pool->failed;
+    if (ok) {
+        ExtractJob *job = &pool->jobs[(pool->head + pool->count) %
+                EXTRACT_MAX_PENDING];
+        job->pEntry = pEntry;
+        job->targetFile = name;
+        job->fd = fd;
+        pool->count++;
+        pthread_cond_signal(&pool->jobReady);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!ok) {
+        close(fd);
+        free(name);
+    }
+    return ok;
+}
+
+/* Start up to EXTRACT_MAX_WORKERS workers, one per online core.
+ * Returns the number started; zero means extract serially.
+ */
+static int extractPoolStart(ExtractPool *pool, ExtractWorker *workers,
+        const ZipArchive *pArchive, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores < 1 ? 1 : cores > EXTRACT_MAX_WORKERS ?
+            EXTRACT_MAX_WORKERS : (int)cores;
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->pArchive = pArchive;
+    pool->timestamp = timestamp;
+    pool->callback = callback;
+    pool->cookie = cookie;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+    pthread_cond_init(&pool->jobTaken, NULL);
+
+    for (i = 0; i < count; i++) {
+        ExtractWorker *worker = &workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->pool = pool;
+        worker->readBuf = (unsigned char *)malloc(EXTRACT_BUF_SIZE);
+        worker->procBuf = (unsigned char *)malloc(EXTRACT_BUF_SIZE);
+        /* No zlib header; see processDeflatedEntry(). */
+        if (worker->readBuf == NULL || worker->procBuf == NULL ||
+                inflateInit2(&worker->zstream, -MAX_WBITS) != Z_OK) {
+            free(worker->readBuf);
+            free(worker->procBuf);
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, extractWorkerThread,
+                worker) != 0) {
+            inflateEnd(&worker->zstream);
+            free(worker->readBuf);
+            free(worker->procBuf);
+            break;
+        }
+    }
+    if (i == 0) {
+        pthread_cond_destroy(&pool->jobTaken);
+        pthread_cond_destroy(&pool->jobReady);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    return i;
+}
+
+/* Wait for the queued files to be written and stop the workers.
+ * Returns false if any of them failed.
+ */
+static bool extractPoolFinish(ExtractPool *pool, ExtractWorker *workers,
+        int count)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = true;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        inflateEnd(&workers[i].zstream);
+        free(workers[i].readBuf);
+        free(workers[i].procBuf);
+    }
+
+    pthread_cond_destroy(&pool->jobTaken);
+    pthread_cond_destroy(&pool->jobReady);
+    pthread_mutex_destroy(&pool->lock);
+    return !pool->failed;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -978,49 +1459,39 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.bufLen = 0;
 
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  The entries are sorted, so those are all together:
+     * binary search for the first one and stop after the last.
      */
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+
+    /* With PARALLEL set, regular files are still created in order here,
+     * but their contents are written by the worker pool.
+     */
+    ExtractPool pool;
+    ExtractWorker workers[EXTRACT_MAX_WORKERS];
+    int workerCount = 0;
+    if ((flags & MZ_EXTRACT_PARALLEL) && !(flags & MZ_EXTRACT_DRY_RUN)) {
+        workerCount = extractPoolStart(&pool, workers, pArchive, timestamp,
+                callback, cookie);
+    }
+
+    for (i = findFirstEntry(pArchive, zpath, zipDirLen);
+            i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
+        /* If zpath is empty, this matches everything, which is what
+         * we want.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
+        if (pEntry->fileNameLen < zipDirLen ||
+                memcmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+            break;
         }
         /* This entry begins with zipDir, so we'll extract it.
          */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -1136,7 +1607,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+                /* The worker touches the file and invokes the callback
+                 * once the contents are written.
+                 */
+                if (workerCount > 0) {
+                    if (!extractPoolAdd(&pool, pEntry, targetFile, fd)) {
+                        ok = false;
+                        break;
+                    }
+                    continue;
+                }
+
+                ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
                 close(fd);
                 if (!ok) {
                     LOGE("Error extracting \"%s\"\n", targetFile);
@@ -1154,7 +1636,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             }
         }
 
-        if (callback != NULL) callback(targetFile, cookie);
+        if (callback != NULL) {
+            if (workerCount > 0) pthread_mutex_lock(&pool.lock);
+            callback(targetFile, cookie);
+            if (workerCount > 0) pthread_mutex_unlock(&pool.lock);
+        }
+    }
+
+    if (workerCount > 0 && !extractPoolFinish(&pool, workers, workerCount)) {
+        ok = false;
     }
 
     free(helper.buf);
@@ -32,9 +32,9 @@ extern "C" {
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    long long    offset;         // of the data, not the local header
+    long long    compLen;
+    long long    uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -48,9 +48,10 @@ typedef struct ZipEntry {
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
-    ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    ZipEntry*   pEntries;       // sorted by name
+    MemMapping  map;            // the whole file, unless it was too large
+    long long   length;         // of the whole file
+    unsigned char* directory;   // central directory copy, if not mapped
 } ZipArchive;
 
 /*
@@ -70,6 +71,16 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive that the caller has already opened as "fd" and
+ * mapped whole with sysMapFileInShmem().
+ *
+ * On success, returns 0 and "pArchive" takes ownership of both the fd and
+ * the mapping.  On failure, returns -1 and the caller still owns them.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap,
+        ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -121,10 +132,10 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -204,14 +215,20 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - inflate regular files on a pool of worker
+ *         threads; directories, symlinks and selabel contexts are still
+ *         created in entry order, but files may finish out of order
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * With MZ_EXTRACT_PARALLEL it may be called from a worker thread, but
+ * never concurrently.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2,
+       MZ_EXTRACT_PARALLEL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
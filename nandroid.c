@@ -37,6 +37,8 @@
 #include "extendedcommands.h"
 #include "recovery_settings.h"
 #include "nandroid.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
@@ -149,43 +151,30 @@ else
     return __pclose(fp);
 }
 
-static int do_tar_compress(char* command, int callback) {
-    char buf[PATH_MAX];
+static int do_tar_compress(const char* backup_path, const char* backup_file, int flags, int callback) {
+    const char* excludes[] = { "data/data/com.google.android.music/files/*", NULL, NULL };
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        excludes[1] = "data/media";
 
     set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-if ( language== 1 )
-        ui_print("Unable to execute tar command!\n");
-else
-        ui_print("无法执行 tar 命令！\n");
-
-        set_perf_mode(0);
-        return -1;
-    }
-
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
-    }
-
+    int ret = nandroid_tar_create(backup_path, backup_file, excludes, flags,
+                                  callback ? nandroid_callback : NULL);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar", backup_file_image);
 
-    return do_tar_compress(tmp, callback);
+    return do_tar_compress(backup_path, tmp, 0, callback);
 }
 
 static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
 
-    return do_tar_compress(tmp, callback);
+    return do_tar_compress(backup_path, tmp, NANDROID_TAR_GZIP, callback);
 }
 
 static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
@@ -216,6 +205,50 @@ else
 
 }
 
+static void build_configuration_path(char *path_buf, const char *file) {
+    sprintf(path_buf, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), file);
+}
+
+#define DEDUPE_MD5_FILE "/tmp/dedupe.md5"
+
+// Find the newest manifest of the same partition in the other backups next to
+// this one, for dedupe to reuse the keys of files that did not change.
+static int find_previous_dedupe_manifest(const char* backup_file_image, char* manifest) {
+    char backup_dir[PATH_MAX];
+    char backups_root[PATH_MAX];
+    char name[PATH_MAX];
+    strcpy(name, backup_file_image);
+    strcpy(name, basename(name));
+    strcat(name, ".dup");
+    strcpy(backup_dir, backup_file_image);
+    strcpy(backup_dir, dirname(backup_dir));
+    strcpy(backups_root, backup_dir);
+    strcpy(backups_root, dirname(backups_root));
+
+    DIR* dir = opendir(backups_root);
+    if (dir == NULL)
+        return -1;
+
+    time_t newest = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backups_root, de->d_name);
+        if (strcmp(path, backup_dir) == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", backups_root, de->d_name, name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= newest) {
+            newest = st.st_mtime;
+            strcpy(manifest, path);
+        }
+    }
+    closedir(dir);
+    return newest != 0 ? 0 : -1;
+}
+
 static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
@@ -234,7 +267,20 @@ static int dedupe_compress_wrapper(const char* backup_path, const char* backup_f
         nandroid_dedupe_gc(blob_dir);
     }
 
-    sprintf(tmp, "dedupe c %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
+    char previous[PATH_MAX];
+    char previous_option[PATH_MAX + 4] = "";
+    if (find_previous_dedupe_manifest(backup_file_image, previous) == 0)
+        sprintf(previous_option, "-p %s", previous);
+
+    struct stat file_info;
+    build_configuration_path(tmp, NANDROID_DEDUPE_COMPRESS_FILE);
+    int compress = stat(tmp, &file_info) == 0;
+    build_configuration_path(tmp, NANDROID_DEDUPE_BINARY_FILE);
+    int binary = stat(tmp, &file_info) == 0;
+
+    unlink(DEDUPE_MD5_FILE);
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    sprintf(tmp, "dedupe c -j %ld -m %s %s %s %s %s %s %s.dup %s", jobs > 0 ? jobs : 1, DEDUPE_MD5_FILE, previous_option, compress ? "-z" : "", binary ? "-b" : "", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
 
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
@@ -252,11 +298,66 @@ else
             nandroid_callback(tmp);
     }
 
-    return __pclose(fp);
+    int ret = __pclose(fp);
+    if (ret == 0) {
+        strcpy(tmp, backup_file_image);
+        nandroid_md5_load(DEDUPE_MD5_FILE, dirname(tmp));
+    }
+    return ret;
 }
 
-static void build_configuration_path(char *path_buf, const char *file) {
-    sprintf(path_buf, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), file);
+// eMMC partitions are plain block devices, so copy them here and hash the
+// image on the way out instead of reading it back for nandroid.md5.
+static int backup_raw_image(const char* fs_type, const char* device, const char* image) {
+    if (strcmp(fs_type, "emmc") != 0 || device[0] != '/' || strcmp(image, "/proc/self/fd/1") == 0)
+        return backup_raw_partition(fs_type, device, image);
+
+    int in = open(device, O_RDONLY);
+    if (in < 0)
+        return -1;
+    int out = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    const size_t buf_size = 1024 * 1024;
+    char* buf = malloc(buf_size);
+    int ret = buf == NULL ? -1 : 0;
+    MD5_CTX md5;
+    MD5_Init(&md5);
+    while (ret == 0) {
+        ssize_t len = read(in, buf, buf_size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            ret = len;
+            break;
+        }
+        MD5_Update(&md5, buf, len);
+        char* p = buf;
+        while (len > 0) {
+            ssize_t written = write(out, p, len);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                ret = -1;
+                break;
+            }
+            p += written;
+            len -= written;
+        }
+    }
+    free(buf);
+    close(in);
+    if (fsync(out) != 0 || close(out) != 0)
+        ret = -1;
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &md5);
+    if (ret == 0)
+        nandroid_md5_add(image, digest);
+    return ret;
 }
 
 static nandroid_backup_handler default_backup_handler = tar_compress_wrapper;
@@ -430,7 +531,7 @@ if ( language== 1 )
 else
         ui_print("正在备份 %s 镜像...\n", name);
 
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        if (0 != (ret = backup_raw_image(vol->fs_type, vol->blk_device, tmp))) {
 if ( language== 1 )
             ui_print("Error while backing up %s image!", name);
 else
@@ -452,6 +553,7 @@ else
 
 int nandroid_backup(const char* backup_path) {
     nandroid_backup_bitfield = 0;
+    nandroid_md5_reset();
     refresh_default_backup_handler();
 
     if (ensure_path_mounted(backup_path) != 0) {
@@ -525,7 +627,7 @@ else
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
+        ret = backup_raw_image(vol->fs_type, vol->blk_device, tmp);
         if (0 != ret)
 
 
@@ -588,8 +690,7 @@ if ( language== 1 )
 else
     ui_print("正在生成 md5 校验值...\n");
 
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_md5_write(backup_path))) {
 
 
 if ( language== 1 )
@@ -686,17 +787,44 @@ else
     return __pclose(fp);
 }
 
-static int do_tar_extract(char* command, int callback) {
+// The archive segments are fed to the extractor by nandroid_tar_reader,
+// which checks their md5 while tar is busy extracting.
+static int do_tar_extract(const char* backup_file_image, const char* backup_path, const char* decompress, int callback) {
     char buf[PATH_MAX];
+    int fd;
 
     set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
+    nandroid_tar_reader* reader = nandroid_tar_reader_start(backup_file_image, &fd);
+    if (reader == NULL) {
+if ( language== 1 )
+        ui_print("Unable to read %s.\n", backup_file_image);
+else
+        ui_print("无法读取 %s。\n", backup_file_image);
+
+        set_perf_mode(0);
+        return -1;
+    }
+
+    if (decompress != NULL)
+        sprintf(buf, "cd $(dirname %s) ; set -o pipefail ; %s <&%d | tar -xpv ; exit $?", backup_path, decompress, fd);
+    else
+        sprintf(buf, "cd $(dirname %s) ; tar -xpv <&%d ; exit $?", backup_path, fd);
+
+    // The reader thread must see EPIPE rather than die if tar quits early.
+    // Only ignore SIGPIPE once the shell is forked so tar and the
+    // decompressor keep the default disposition, and we still hold the read
+    // end of the pipe until then.
+    FILE *fp = __popen(buf, "r");
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    close(fd);
     if (fp == NULL) {
 if ( language== 1 )
         ui_print("Unable to execute tar command.\n");
 else
         ui_print("无法执行 tar 命令。\n");
 
+        nandroid_tar_reader_finish(reader);
+        signal(SIGPIPE, old_sigpipe);
         set_perf_mode(0);
         return -1;
     }
@@ -707,22 +835,26 @@ else
             nandroid_callback(buf);
     }
 
+    int ret = __pclose(fp);
+    if (0 != nandroid_tar_reader_finish(reader)) {
+if ( language== 1 )
+        ui_print("MD5 mismatch!\n");
+else
+        ui_print("MD5 校验值不匹配！\n");
+
+        ret = -1;
+    }
+    signal(SIGPIPE, old_sigpipe);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
 static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_path, backup_file_image);
-
-    return do_tar_extract(tmp, callback);
+    return do_tar_extract(backup_file_image, backup_path, "pigz -d -c", callback);
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_path, backup_file_image);
-
-    return do_tar_extract(tmp, callback);
+    return do_tar_extract(backup_file_image, backup_path, NULL, callback);
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -734,7 +866,8 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     bd = dirname(blob_dir);
     strcpy(blob_dir, bd);
     bd = dirname(blob_dir);
-    sprintf(tmp, "dedupe x %s %s/blobs %s; exit $?", backup_file_image, bd, backup_path);
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    sprintf(tmp, "dedupe x -j %ld %s %s/blobs %s; exit $?", jobs > 0 ? jobs : 1, backup_file_image, bd, backup_path);
 
     char path[PATH_MAX];
     FILE *fp = __popen(tmp, "r");
@@ -1020,8 +1153,11 @@ if ( language== 1 )
 else
     ui_print("正在检查 MD5 校验值...\n");
 
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
+    // tar archives are checked segment by segment while they are extracted
+    const char* streamed[] = { "*.tar", "*.tar.?", "*.tar.gz", "*.tar.gz.?", NULL };
+    nandroid_md5_reset();
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    if (0 != nandroid_md5_load(tmp, backup_path) || 0 != nandroid_md5_verify(backup_path, streamed))
 
 
 if ( language== 1 )
@@ -0,0 +1,290 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "recovery_ui.h"
+#include "nandroid_md5.h"
+
+#define MD5_READ_SIZE (1024 * 1024)
+
+// Backup directories are flat, so entries are keyed by file name.
+struct md5_entry {
+    char* name;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    struct md5_entry* next;
+};
+
+static pthread_mutex_t md5_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct md5_entry* md5_entries = NULL;
+
+static const char* file_name(const char* path) {
+    const char* name = strrchr(path, '/');
+    return name != NULL ? name + 1 : path;
+}
+
+void nandroid_md5_reset() {
+    pthread_mutex_lock(&md5_lock);
+    while (md5_entries != NULL) {
+        struct md5_entry* next = md5_entries->next;
+        free(md5_entries->name);
+        free(md5_entries);
+        md5_entries = next;
+    }
+    pthread_mutex_unlock(&md5_lock);
+}
+
+void nandroid_md5_add(const char* path, const unsigned char digest[MD5_DIGEST_LENGTH]) {
+    const char* name = file_name(path);
+    struct md5_entry* entry;
+
+    pthread_mutex_lock(&md5_lock);
+    for (entry = md5_entries; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0)
+            break;
+    }
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct md5_entry));
+        if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+            free(entry);
+            pthread_mutex_unlock(&md5_lock);
+            return;
+        }
+        entry->next = md5_entries;
+        md5_entries = entry;
+    }
+    memcpy(entry->digest, digest, MD5_DIGEST_LENGTH);
+    pthread_mutex_unlock(&md5_lock);
+}
+
+int nandroid_md5_get(const char* path, unsigned char digest[MD5_DIGEST_LENGTH]) {
+    const char* name = file_name(path);
+    struct md5_entry* entry;
+    int found = 0;
+
+    pthread_mutex_lock(&md5_lock);
+    for (entry = md5_entries; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            memcpy(digest, entry->digest, MD5_DIGEST_LENGTH);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&md5_lock);
+    return found;
+}
+
+static int parse_hex_digest(const char* hex, unsigned char digest[MD5_DIGEST_LENGTH]) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        digest[i] = byte;
+    }
+    return 0;
+}
+
+int nandroid_md5_load(const char* md5_file, const char* backup_path) {
+    char line[PATH_MAX + 64];
+    char path[PATH_MAX];
+    FILE* f = fopen(md5_file, "r");
+    if (f == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        // "<32 hex digits>  <file>"
+        if (len < 2 * MD5_DIGEST_LENGTH + 3 || parse_hex_digest(line, digest) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backup_path, line + 2 * MD5_DIGEST_LENGTH + 2);
+        nandroid_md5_add(path, digest);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int md5_file(const char* path, unsigned char digest[MD5_DIGEST_LENGTH]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    unsigned char* buf = malloc(MD5_READ_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    ssize_t len;
+    MD5_Init(&ctx);
+    while ((len = read(fd, buf, MD5_READ_SIZE)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        MD5_Update(&ctx, buf, len);
+    }
+    MD5_Final(digest, &ctx);
+
+    free(buf);
+    close(fd);
+    return len < 0 ? -1 : 0;
+}
+
+static int name_compare(const void* a, const void* b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+int nandroid_md5_write(const char* backup_path) {
+    char path[PATH_MAX];
+    char** names = NULL;
+    int count = 0;
+    int capacity = 0;
+    int ret = 0;
+    int i;
+
+    DIR* dir = opendir(backup_path);
+    if (dir == NULL)
+        return -1;
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        // nandroid-md5.sh wrote its list to /tmp and copied it in last
+        if (strcmp(de->d_name, "nandroid.md5") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backup_path, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (count == capacity) {
+            capacity = capacity == 0 ? 32 : capacity * 2;
+            char** grown = realloc(names, capacity * sizeof(char*));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            names = grown;
+        }
+        if ((names[count] = strdup(de->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    if (ret == 0)
+        qsort(names, count, sizeof(char*), name_compare);
+
+    snprintf(path, sizeof(path), "%s/nandroid.md5", backup_path);
+    FILE* out = ret == 0 ? fopen(path, "w") : NULL;
+    if (out == NULL)
+        ret = -1;
+
+    for (i = 0; ret == 0 && i < count; i++) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        if (!nandroid_md5_get(names[i], digest)) {
+            snprintf(path, sizeof(path), "%s/%s", backup_path, names[i]);
+            LOGI("Hashing %s\n", path);
+            if (md5_file(path, digest) != 0) {
+if ( language== 1 )
+                LOGE("Unable to read %s\n", path);
+else
+                LOGE("无法读取 %s\n", path);
+
+                ret = -1;
+                break;
+            }
+        }
+        int j;
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(out, "%02x", digest[j]);
+        fprintf(out, "  %s\n", names[i]);
+    }
+
+    if (out != NULL && fclose(out) != 0)
+        ret = -1;
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+static int is_skipped(const char* name, const char** skip) {
+    if (skip == NULL)
+        return 0;
+    for (; *skip != NULL; skip++) {
+        if (fnmatch(*skip, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int nandroid_md5_verify(const char* backup_path, const char** skip) {
+    char path[PATH_MAX];
+    char** names = NULL;
+    unsigned char* expected = NULL;
+    int count = 0;
+    int ret = 0;
+    int i;
+
+    // snapshot the list so the files are hashed without holding the lock
+    pthread_mutex_lock(&md5_lock);
+    struct md5_entry* entry;
+    for (entry = md5_entries; entry != NULL; entry = entry->next)
+        count++;
+    names = calloc(count, sizeof(char*));
+    expected = malloc(count * MD5_DIGEST_LENGTH);
+    if (count > 0 && (names == NULL || expected == NULL)) {
+        pthread_mutex_unlock(&md5_lock);
+        free(names);
+        free(expected);
+        return -1;
+    }
+    for (i = 0, entry = md5_entries; entry != NULL; entry = entry->next, i++) {
+        names[i] = strdup(entry->name);
+        memcpy(expected + i * MD5_DIGEST_LENGTH, entry->digest, MD5_DIGEST_LENGTH);
+    }
+    pthread_mutex_unlock(&md5_lock);
+
+    for (i = 0; i < count; i++) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        if (names[i] == NULL) {
+            ret = -1;
+            break;
+        }
+        if (is_skipped(names[i], skip))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backup_path, names[i]);
+        if (md5_file(path, digest) != 0 ||
+                memcmp(digest, expected + i * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH) != 0) {
+if ( language== 1 )
+            LOGE("MD5 mismatch: %s\n", path);
+else
+            LOGE("MD5 校验值不匹配: %s\n", path);
+
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    free(expected);
+    return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef NANDROID_MD5_H
+#define NANDROID_MD5_H
+
+#include <openssl/md5.h>
+
+// The backup writers hash what they write and record the digests here, so
+// nandroid.md5 can be produced without reading the backup back from storage.
+// All functions are safe to call from any thread.
+
+// Forget all recorded digests (call before starting a new backup).
+void nandroid_md5_reset();
+
+// Record the md5 of a file written to the backup directory.
+void nandroid_md5_add(const char* path, const unsigned char digest[MD5_DIGEST_LENGTH]);
+
+// Look up the digest recorded for path, returns 1 if there is one.
+int nandroid_md5_get(const char* path, unsigned char digest[MD5_DIGEST_LENGTH]);
+
+// Record every "digest  file" line of an md5sum formatted file; the file
+// names are taken relative to backup_path.
+int nandroid_md5_load(const char* md5_file, const char* backup_path);
+
+// Write backup_path/nandroid.md5 (md5sum -c format) covering every regular
+// file of backup_path. Files that were not recorded are hashed now.
+int nandroid_md5_write(const char* backup_path);
+
+// Check the files of backup_path against their recorded digests, except
+// those matching one of the NULL terminated fnmatch() patterns in skip
+// (which may be NULL). Returns 0 if they all match.
+int nandroid_md5_verify(const char* backup_path, const char** skip);
+
+#endif
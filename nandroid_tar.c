@@ -0,0 +1,1127 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "recovery_ui.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
+
+// Size of the uncompressed pieces of the tar stream handed to the workers.
+// Each gzip worker needs the last 32k of the previous block as dictionary,
+// so blocks much smaller than this hurt the compression ratio.
+#define TAR_BLOCK_SIZE (256 * 1024)
+#define TAR_DICT_SIZE 32768
+#define TAR_RECORD_SIZE 512
+// GNU tar default blocking factor (20 records)
+#define TAR_BLOCKING_SIZE (20 * TAR_RECORD_SIZE)
+#define TAR_MAX_WORKERS 16
+#define TAR_LINK_BUCKETS 256
+// pigz default
+#define TAR_GZIP_LEVEL 6
+
+enum {
+    BLOCK_PENDING,
+    BLOCK_BUSY,
+    BLOCK_DONE
+};
+
+struct tar_block {
+    unsigned long seq;
+    int state;
+    int last;
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+    unsigned char dict[TAR_DICT_SIZE];
+    size_t dict_len;
+    uLong crc;
+    struct tar_block* next;
+};
+
+struct tar_link {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+    struct tar_link* next;
+};
+
+struct tar_context {
+    const char* output_file;
+    const char** excludes;
+    int gzip;
+    nandroid_tar_callback callback;
+
+    // producer side, owned by the calling thread
+    struct tar_block* current;
+    unsigned long next_seq;
+    struct tar_link* links[TAR_LINK_BUCKETS];
+
+    // in flight blocks, in stream order
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_cond_t space_cond;
+    struct tar_block* head;
+    struct tar_block* tail;
+    struct tar_block* next_pending;
+    int in_flight;
+    int max_in_flight;
+    int finished;
+    int shutdown;
+    int error;
+
+    // writer side, owned by the writer thread
+    int seg_fd;
+    int seg_index;
+    long long seg_written;
+    char seg_name[PATH_MAX];
+    MD5_CTX seg_md5;
+    uLong crc;
+    uLong total_in;
+};
+
+static void set_error(struct tar_context* ctx, int error) {
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->error == 0)
+        ctx->error = error;
+    pthread_cond_broadcast(&ctx->done_cond);
+    pthread_cond_broadcast(&ctx->space_cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static int get_error(struct tar_context* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    int error = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+    return error;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Segments are hashed as they are written, for nandroid.md5
+static int close_segment(struct tar_context* ctx) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    int ret = close(ctx->seg_fd);
+    ctx->seg_fd = -1;
+    MD5_Final(digest, &ctx->seg_md5);
+    if (ret == 0)
+        nandroid_md5_add(ctx->seg_name, digest);
+    return ret;
+}
+
+// Same naming as "split -a 1": output_file.a, output_file.b, ...
+static int write_segments(struct tar_context* ctx, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        if (ctx->seg_fd < 0) {
+            char* name = ctx->seg_name;
+            if (ctx->seg_index >= 26) {
+if ( language== 1 )
+                LOGE("Backup too large for %s\n", ctx->output_file);
+else
+                LOGE("备份文件过大: %s\n", ctx->output_file);
+
+                return -1;
+            }
+            snprintf(name, sizeof(ctx->seg_name), "%s.%c", ctx->output_file, 'a' + ctx->seg_index);
+            ctx->seg_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (ctx->seg_fd < 0) {
+if ( language== 1 )
+                LOGE("Unable to create %s (%s)\n", name, strerror(errno));
+else
+                LOGE("无法创建 %s (%s)\n", name, strerror(errno));
+
+                return -1;
+            }
+            ctx->seg_index++;
+            ctx->seg_written = 0;
+            MD5_Init(&ctx->seg_md5);
+        }
+
+        size_t chunk = len;
+        if ((long long)chunk > NANDROID_TAR_SEGMENT_SIZE - ctx->seg_written)
+            chunk = NANDROID_TAR_SEGMENT_SIZE - ctx->seg_written;
+        if (write_all(ctx->seg_fd, data, chunk) != 0) {
+if ( language== 1 )
+            LOGE("Error writing backup segment (%s)\n", strerror(errno));
+else
+            LOGE("写入备份分段时出错 (%s)\n", strerror(errno));
+
+            return -1;
+        }
+        MD5_Update(&ctx->seg_md5, data, chunk);
+        data += chunk;
+        len -= chunk;
+        ctx->seg_written += chunk;
+        if (ctx->seg_written == NANDROID_TAR_SEGMENT_SIZE && close_segment(ctx) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int write_le32(struct tar_context* ctx, uLong value) {
+    unsigned char buf[4];
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
+    return write_segments(ctx, buf, sizeof(buf));
+}
+
+static int write_block(struct tar_context* ctx, struct tar_block* block) {
+    if (!ctx->gzip)
+        return write_segments(ctx, block->in, block->in_len);
+
+    if (block->seq == 0) {
+        // magic, deflate, no flags, no mtime, no extra flags, unix
+        static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        if (write_segments(ctx, header, sizeof(header)) != 0)
+            return -1;
+    }
+    if (write_segments(ctx, block->out, block->out_len) != 0)
+        return -1;
+    ctx->crc = crc32_combine(ctx->crc, block->crc, block->in_len);
+    ctx->total_in += block->in_len;
+    if (block->last) {
+        if (write_le32(ctx, ctx->crc) != 0 || write_le32(ctx, ctx->total_in) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void free_block(struct tar_block* block) {
+    free(block->in);
+    free(block->out);
+    free(block);
+}
+
+static void* writer_thread(void* cookie) {
+    struct tar_context* ctx = (struct tar_context*)cookie;
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        while (!ctx->error && (ctx->head == NULL || ctx->head->state != BLOCK_DONE)) {
+            if (ctx->finished && ctx->head == NULL)
+                break;
+            pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+        }
+        struct tar_block* block = ctx->head;
+        if (ctx->error || block == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        ctx->head = block->next;
+        if (ctx->head == NULL)
+            ctx->tail = NULL;
+        ctx->in_flight--;
+        pthread_cond_signal(&ctx->space_cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        int ret = write_block(ctx, block);
+        free_block(block);
+        if (ret != 0) {
+            set_error(ctx, -1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Deflate one block as a piece of a single raw deflate stream: primed with
+// the tail of the previous block and ended on a byte boundary with
+// Z_SYNC_FLUSH, so the pieces can simply be concatenated (this is what pigz does).
+static int compress_block(z_stream* strm, struct tar_block* block) {
+    size_t capacity = deflateBound(strm, block->in_len) + 64;
+    block->out = malloc(capacity);
+    if (block->out == NULL)
+        return -1;
+
+    if (deflateReset(strm) != Z_OK)
+        return -1;
+    if (block->dict_len > 0 &&
+            deflateSetDictionary(strm, block->dict, block->dict_len) != Z_OK)
+        return -1;
+
+    int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    strm->next_in = block->in;
+    strm->avail_in = block->in_len;
+    block->out_len = 0;
+    while (1) {
+        strm->next_out = block->out + block->out_len;
+        strm->avail_out = capacity - block->out_len;
+        int ret = deflate(strm, flush);
+        block->out_len = capacity - strm->avail_out;
+        if (ret == Z_STREAM_END)
+            break;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return -1;
+        if (strm->avail_out != 0 && flush == Z_SYNC_FLUSH)
+            break;
+        // out of room, grow the buffer and keep going
+        capacity *= 2;
+        unsigned char* out = realloc(block->out, capacity);
+        if (out == NULL)
+            return -1;
+        block->out = out;
+    }
+
+    block->crc = crc32(crc32(0L, Z_NULL, 0), block->in, block->in_len);
+    return 0;
+}
+
+static void* compress_thread(void* cookie) {
+    struct tar_context* ctx = (struct tar_context*)cookie;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, TAR_GZIP_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        set_error(ctx, -1);
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        while (!ctx->shutdown && !ctx->error && ctx->next_pending == NULL)
+            pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+        struct tar_block* block = ctx->next_pending;
+        if (ctx->shutdown || ctx->error || block == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        block->state = BLOCK_BUSY;
+        ctx->next_pending = block->next;
+        pthread_mutex_unlock(&ctx->lock);
+
+        int ret = compress_block(&strm, block);
+
+        pthread_mutex_lock(&ctx->lock);
+        block->state = BLOCK_DONE;
+        if (ret != 0 && ctx->error == 0)
+            ctx->error = -1;
+        pthread_cond_broadcast(&ctx->done_cond);
+        pthread_cond_broadcast(&ctx->space_cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    deflateEnd(&strm);
+    return NULL;
+}
+
+static struct tar_block* new_block(struct tar_context* ctx, struct tar_block* previous) {
+    struct tar_block* block = malloc(sizeof(struct tar_block));
+    if (block == NULL)
+        return NULL;
+    block->in = malloc(TAR_BLOCK_SIZE);
+    if (block->in == NULL) {
+        free(block);
+        return NULL;
+    }
+    block->seq = ctx->next_seq++;
+    block->state = BLOCK_PENDING;
+    block->last = 0;
+    block->in_len = 0;
+    block->out = NULL;
+    block->out_len = 0;
+    block->dict_len = 0;
+    block->crc = 0;
+    block->next = NULL;
+    if (ctx->gzip && previous != NULL) {
+        block->dict_len = previous->in_len < TAR_DICT_SIZE ? previous->in_len : TAR_DICT_SIZE;
+        memcpy(block->dict, previous->in + previous->in_len - block->dict_len, block->dict_len);
+    }
+    return block;
+}
+
+// Hand the current block over to the workers (or straight to the writer when
+// not compressing), blocking while too many blocks are in flight.
+static int submit_block(struct tar_context* ctx, int last) {
+    struct tar_block* block = ctx->current;
+    block->last = last;
+
+    struct tar_block* next = NULL;
+    if (!last) {
+        // the dictionary has to be copied before the writer can free this block
+        next = new_block(ctx, block);
+        if (next == NULL) {
+            set_error(ctx, -1);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->error && ctx->in_flight >= ctx->max_in_flight)
+        pthread_cond_wait(&ctx->space_cond, &ctx->lock);
+    if (ctx->error) {
+        int error = ctx->error;
+        pthread_mutex_unlock(&ctx->lock);
+        free_block(block);
+        if (next != NULL)
+            free_block(next);
+        ctx->current = NULL;
+        return error;
+    }
+
+    if (!ctx->gzip)
+        block->state = BLOCK_DONE;
+    if (ctx->tail != NULL)
+        ctx->tail->next = block;
+    else
+        ctx->head = block;
+    ctx->tail = block;
+    if (ctx->gzip && ctx->next_pending == NULL)
+        ctx->next_pending = block;
+    ctx->in_flight++;
+    pthread_cond_signal(&ctx->work_cond);
+    pthread_cond_broadcast(&ctx->done_cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    ctx->current = next;
+    return 0;
+}
+
+static int tar_write(struct tar_context* ctx, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    while (len > 0) {
+        size_t room = TAR_BLOCK_SIZE - ctx->current->in_len;
+        size_t chunk = len < room ? len : room;
+        if (p != NULL)
+            memcpy(ctx->current->in + ctx->current->in_len, p, chunk);
+        else
+            memset(ctx->current->in + ctx->current->in_len, 0, chunk);
+        ctx->current->in_len += chunk;
+        if (p != NULL)
+            p += chunk;
+        len -= chunk;
+        if (ctx->current->in_len == TAR_BLOCK_SIZE) {
+            int ret = submit_block(ctx, 0);
+            if (ret != 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+static int tar_pad(struct tar_context* ctx, unsigned long long size) {
+    size_t rem = size % TAR_RECORD_SIZE;
+    if (rem == 0)
+        return 0;
+    return tar_write(ctx, NULL, TAR_RECORD_SIZE - rem);
+}
+
+// Numeric header fields are NUL terminated octal, falling back to the GNU
+// base-256 encoding for values that do not fit (files >= 8GB).
+static void tar_number(char* field, int width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", width - 1, value);
+        return;
+    }
+    int i;
+    for (i = width - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static int tar_put_header(struct tar_context* ctx, struct tar_header* header) {
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    unsigned int sum = 0;
+    const unsigned char* p = (const unsigned char*)header;
+    size_t i;
+    for (i = 0; i < sizeof(*header); i++)
+        sum += p[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+
+    return tar_write(ctx, header, sizeof(*header));
+}
+
+// GNU ././@LongLink entry carrying a name that does not fit in 100 bytes
+static int tar_put_long_name(struct tar_context* ctx, char type, const char* name) {
+    struct tar_header header;
+    size_t len = strlen(name) + 1;
+    int ret;
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.name, "././@LongLink");
+    tar_number(header.mode, sizeof(header.mode), 0);
+    tar_number(header.uid, sizeof(header.uid), 0);
+    tar_number(header.gid, sizeof(header.gid), 0);
+    tar_number(header.size, sizeof(header.size), len);
+    tar_number(header.mtime, sizeof(header.mtime), 0);
+    header.typeflag = type;
+    if ((ret = tar_put_header(ctx, &header)) != 0)
+        return ret;
+    if ((ret = tar_write(ctx, name, len)) != 0)
+        return ret;
+    return tar_pad(ctx, len);
+}
+
+static int tar_put_entry(struct tar_context* ctx, const char* name, const struct stat* st,
+                         char type, const char* linkname, unsigned long long size) {
+    struct tar_header header;
+    int ret;
+
+    if (strlen(name) > sizeof(header.name) &&
+            (ret = tar_put_long_name(ctx, 'L', name)) != 0)
+        return ret;
+    if (linkname != NULL && strlen(linkname) > sizeof(header.linkname) &&
+            (ret = tar_put_long_name(ctx, 'K', linkname)) != 0)
+        return ret;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name));
+    tar_number(header.mode, sizeof(header.mode), st->st_mode & 07777);
+    tar_number(header.uid, sizeof(header.uid), st->st_uid);
+    tar_number(header.gid, sizeof(header.gid), st->st_gid);
+    tar_number(header.size, sizeof(header.size), size);
+    tar_number(header.mtime, sizeof(header.mtime), st->st_mtime);
+    header.typeflag = type;
+    if (linkname != NULL)
+        strncpy(header.linkname, linkname, sizeof(header.linkname));
+    if (type == '3' || type == '4') {
+        tar_number(header.devmajor, sizeof(header.devmajor), major(st->st_rdev));
+        tar_number(header.devminor, sizeof(header.devminor), minor(st->st_rdev));
+    }
+    return tar_put_header(ctx, &header);
+}
+
+// Read the file straight into the block buffers. Files that shrink while
+// being archived are padded with zeroes so the header size stays valid.
+static int tar_put_file_data(struct tar_context* ctx, const char* path, unsigned long long size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+if ( language== 1 )
+        LOGE("Unable to open %s (%s)\n", path, strerror(errno));
+else
+        LOGE("无法打开 %s (%s)\n", path, strerror(errno));
+
+        return -1;
+    }
+
+    unsigned long long remaining = size;
+    while (remaining > 0) {
+        struct tar_block* block = ctx->current;
+        size_t room = TAR_BLOCK_SIZE - block->in_len;
+        if (room > remaining)
+            room = remaining;
+        ssize_t bytes = read(fd, block->in + block->in_len, room);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0) {
+if ( language== 1 )
+            LOGE("Error reading %s (%s)\n", path, strerror(errno));
+else
+            LOGE("读取 %s 时出错 (%s)\n", path, strerror(errno));
+
+            close(fd);
+            return -1;
+        }
+        if (bytes == 0)
+            break;
+        block->in_len += bytes;
+        remaining -= bytes;
+        if (block->in_len == TAR_BLOCK_SIZE) {
+            int ret = submit_block(ctx, 0);
+            if (ret != 0) {
+                close(fd);
+                return ret;
+            }
+        }
+    }
+    close(fd);
+
+    int ret;
+    if (remaining > 0 && (ret = tar_write(ctx, NULL, remaining)) != 0)
+        return ret;
+    return tar_pad(ctx, size);
+}
+
+// Returns the name of the first archived path of a hard linked inode, or
+// records name as the first one.
+static const char* tar_find_link(struct tar_context* ctx, const struct stat* st, const char* name) {
+    unsigned int bucket = (unsigned int)(st->st_ino ^ st->st_dev) % TAR_LINK_BUCKETS;
+    struct tar_link* link;
+    for (link = ctx->links[bucket]; link != NULL; link = link->next) {
+        if (link->ino == st->st_ino && link->dev == st->st_dev)
+            return link->name;
+    }
+
+    link = malloc(sizeof(struct tar_link));
+    if (link != NULL && (link->name = strdup(name)) != NULL) {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        link->next = ctx->links[bucket];
+        ctx->links[bucket] = link;
+    } else {
+        free(link);
+    }
+    return NULL;
+}
+
+static int is_excluded(struct tar_context* ctx, const char* name) {
+    const char** exclude;
+    if (ctx->excludes == NULL)
+        return 0;
+    for (exclude = ctx->excludes; *exclude != NULL; exclude++) {
+        if (fnmatch(*exclude, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// path is the absolute path, name the archive name (a suffix of path)
+static int tar_put_path(struct tar_context* ctx, char* path, const char* name) {
+    struct stat st;
+    int ret;
+
+    if (is_excluded(ctx, name))
+        return 0;
+    if (lstat(path, &st) != 0) {
+if ( language== 1 )
+        LOGE("Unable to stat %s (%s)\n", path, strerror(errno));
+else
+        LOGE("无法获取 %s 的状态 (%s)\n", path, strerror(errno));
+
+        return -1;
+    }
+
+    if (ctx->callback != NULL)
+        ctx->callback(name);
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            const char* target = tar_find_link(ctx, &st, name);
+            if (target != NULL)
+                return tar_put_entry(ctx, name, &st, '1', target, 0);
+        }
+        if ((ret = tar_put_entry(ctx, name, &st, '0', NULL, st.st_size)) != 0)
+            return ret;
+        return tar_put_file_data(ctx, path, st.st_size);
+    } else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0) {
+if ( language== 1 )
+            LOGE("Unable to read symlink %s\n", path);
+else
+            LOGE("无法读取符号链接 %s\n", path);
+
+            return -1;
+        }
+        target[len] = '\0';
+        return tar_put_entry(ctx, name, &st, '2', target, 0);
+    } else if (S_ISCHR(st.st_mode)) {
+        return tar_put_entry(ctx, name, &st, '3', NULL, 0);
+    } else if (S_ISBLK(st.st_mode)) {
+        return tar_put_entry(ctx, name, &st, '4', NULL, 0);
+    } else if (S_ISFIFO(st.st_mode)) {
+        return tar_put_entry(ctx, name, &st, '6', NULL, 0);
+    } else if (!S_ISDIR(st.st_mode)) {
+        // sockets, like tar does
+        LOGI("Skipping socket %s\n", path);
+        return 0;
+    }
+
+    char dir_name[PATH_MAX];
+    snprintf(dir_name, sizeof(dir_name), "%s/", name);
+    if ((ret = tar_put_entry(ctx, dir_name, &st, '5', NULL, 0)) != 0)
+        return ret;
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+if ( language== 1 )
+        LOGE("Unable to open directory %s\n", path);
+else
+        LOGE("无法打开目录 %s\n", path);
+
+        return -1;
+    }
+
+    size_t path_len = strlen(path);
+    size_t name_offset = name - path;
+    struct dirent* de;
+    ret = 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (path_len + 1 + strlen(de->d_name) >= PATH_MAX) {
+            LOGE("%s/%s: path too long\n", path, de->d_name);
+            ret = -1;
+            break;
+        }
+        path[path_len] = '/';
+        strcpy(path + path_len + 1, de->d_name);
+        ret = tar_put_path(ctx, path, path + name_offset);
+        path[path_len] = '\0';
+        if (ret != 0)
+            break;
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int online_cpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > TAR_MAX_WORKERS)
+        return TAR_MAX_WORKERS;
+    return (int)cpus;
+}
+
+int nandroid_tar_create(const char* source_dir, const char* output_file,
+                        const char** excludes, int flags,
+                        nandroid_tar_callback callback) {
+    struct tar_context ctx;
+    pthread_t writer;
+    pthread_t workers[TAR_MAX_WORKERS];
+    int num_workers = 0;
+    int ret = 0;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.output_file = output_file;
+    ctx.excludes = excludes;
+    ctx.gzip = (flags & NANDROID_TAR_GZIP) != 0;
+    ctx.callback = callback;
+    ctx.seg_fd = -1;
+    ctx.crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.work_cond, NULL);
+    pthread_cond_init(&ctx.done_cond, NULL);
+    pthread_cond_init(&ctx.space_cond, NULL);
+
+    // the restore code looks for the unsuffixed file
+    int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+if ( language== 1 )
+        LOGE("Unable to create %s (%s)\n", output_file, strerror(errno));
+else
+        LOGE("无法创建 %s (%s)\n", output_file, strerror(errno));
+
+        ret = -1;
+        goto destroy;
+    }
+    close(fd);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char*)"", 0, digest);
+    nandroid_md5_add(output_file, digest);
+
+    char path[PATH_MAX];
+    strncpy(path, source_dir, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    const char* name = strrchr(path, '/');
+    name = name != NULL && name[1] != '\0' ? name + 1 : path;
+
+    if (ctx.gzip)
+        num_workers = online_cpus();
+    ctx.max_in_flight = 2 * num_workers + 2;
+
+    ctx.current = new_block(&ctx, NULL);
+    if (ctx.current == NULL) {
+        ret = -1;
+        goto destroy;
+    }
+
+    if (pthread_create(&writer, NULL, writer_thread, &ctx) != 0) {
+        free_block(ctx.current);
+        ret = -1;
+        goto destroy;
+    }
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, compress_thread, &ctx) != 0)
+            break;
+    }
+    num_workers = i;
+    if (ctx.gzip && num_workers == 0)
+        set_error(&ctx, -1);
+
+    LOGI("Archiving %s to %s with %d compression threads\n", source_dir, output_file, num_workers);
+
+    if (get_error(&ctx) == 0)
+        ret = tar_put_path(&ctx, path, name);
+    if (ret == 0 && ctx.current != NULL) {
+        // end of archive: two zero records, padded to the blocking factor
+        unsigned long long total = (ctx.next_seq - 1) * (unsigned long long)TAR_BLOCK_SIZE + ctx.current->in_len;
+        size_t trailer = 2 * TAR_RECORD_SIZE;
+        trailer += (TAR_BLOCKING_SIZE - (total + trailer) % TAR_BLOCKING_SIZE) % TAR_BLOCKING_SIZE;
+        ret = tar_write(&ctx, NULL, trailer);
+    }
+    if (ret == 0 && ctx.current != NULL)
+        ret = submit_block(&ctx, 1);
+    if (ret != 0) {
+        set_error(&ctx, ret);
+        if (ctx.current != NULL)
+            free_block(ctx.current);
+        ctx.current = NULL;
+    }
+
+    pthread_mutex_lock(&ctx.lock);
+    ctx.finished = 1;
+    pthread_cond_broadcast(&ctx.done_cond);
+    pthread_mutex_unlock(&ctx.lock);
+    pthread_join(writer, NULL);
+
+    pthread_mutex_lock(&ctx.lock);
+    ctx.shutdown = 1;
+    pthread_cond_broadcast(&ctx.work_cond);
+    pthread_mutex_unlock(&ctx.lock);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    // blocks left behind after an error
+    while (ctx.head != NULL) {
+        struct tar_block* next = ctx.head->next;
+        free_block(ctx.head);
+        ctx.head = next;
+    }
+    for (i = 0; i < TAR_LINK_BUCKETS; i++) {
+        while (ctx.links[i] != NULL) {
+            struct tar_link* next = ctx.links[i]->next;
+            free(ctx.links[i]->name);
+            free(ctx.links[i]);
+            ctx.links[i] = next;
+        }
+    }
+
+    if (ctx.seg_fd >= 0 && close_segment(&ctx) != 0 && ctx.error == 0)
+        ctx.error = -1;
+
+destroy:
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.work_cond);
+    pthread_cond_destroy(&ctx.done_cond);
+    pthread_cond_destroy(&ctx.space_cond);
+
+    return ctx.error != 0 ? ctx.error : ret;
+}
+
+#define READER_BUFFER_SIZE (1024 * 1024)
+#define READER_BUFFERS 8
+
+struct reader_buffer {
+    unsigned char* data;
+    size_t len;
+    struct reader_buffer* next;
+};
+
+struct segment_check {
+    struct nandroid_tar_reader* reader;
+    pthread_t thread;
+    char path[PATH_MAX];
+    unsigned char expected[MD5_DIGEST_LENGTH];
+    // buffers waiting to be hashed, in file order
+    struct reader_buffer* head;
+    struct reader_buffer* tail;
+    int eof;
+    struct segment_check* next;
+};
+
+struct nandroid_tar_reader {
+    char archive_file[PATH_MAX];
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct reader_buffer buffers[READER_BUFFERS];
+    struct reader_buffer* free_list;
+    struct segment_check* checks;
+    int mismatch;
+    int error;
+};
+
+static void release_buffer(nandroid_tar_reader* reader, struct reader_buffer* buffer) {
+    pthread_mutex_lock(&reader->lock);
+    buffer->next = reader->free_list;
+    reader->free_list = buffer;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+// One per segment: hashes the buffers of its segment after they were handed
+// to the extractor, while the reader moves on.
+static void* segment_check_thread(void* cookie) {
+    struct segment_check* check = (struct segment_check*)cookie;
+    nandroid_tar_reader* reader = check->reader;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_CTX md5;
+
+    MD5_Init(&md5);
+    while (1) {
+        pthread_mutex_lock(&reader->lock);
+        while (check->head == NULL && !check->eof)
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        struct reader_buffer* buffer = check->head;
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+        check->head = buffer->next;
+        if (check->head == NULL)
+            check->tail = NULL;
+        pthread_mutex_unlock(&reader->lock);
+
+        MD5_Update(&md5, buffer->data, buffer->len);
+        release_buffer(reader, buffer);
+    }
+    MD5_Final(digest, &md5);
+
+    if (memcmp(digest, check->expected, MD5_DIGEST_LENGTH) != 0) {
+if ( language== 1 )
+        LOGE("MD5 mismatch: %s\n", check->path);
+else
+        LOGE("MD5 校验值不匹配: %s\n", check->path);
+
+        pthread_mutex_lock(&reader->lock);
+        reader->mismatch = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return NULL;
+}
+
+static struct reader_buffer* get_buffer(nandroid_tar_reader* reader) {
+    pthread_mutex_lock(&reader->lock);
+    while (reader->free_list == NULL && !reader->mismatch)
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    struct reader_buffer* buffer = NULL;
+    if (!reader->mismatch) {
+        buffer = reader->free_list;
+        reader->free_list = buffer->next;
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return buffer;
+}
+
+static int stream_segment(nandroid_tar_reader* reader, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+if ( language== 1 )
+        LOGE("Unable to open %s (%s)\n", path, strerror(errno));
+else
+        LOGE("无法打开 %s (%s)\n", path, strerror(errno));
+
+        return -1;
+    }
+
+    struct segment_check* check = NULL;
+    unsigned char expected[MD5_DIGEST_LENGTH];
+    if (nandroid_md5_get(path, expected)) {
+        check = calloc(1, sizeof(struct segment_check));
+        if (check == NULL) {
+            close(fd);
+            return -1;
+        }
+        check->reader = reader;
+        strcpy(check->path, path);
+        memcpy(check->expected, expected, MD5_DIGEST_LENGTH);
+        if (pthread_create(&check->thread, NULL, segment_check_thread, check) != 0) {
+            free(check);
+            close(fd);
+            return -1;
+        }
+        check->next = reader->checks;
+        reader->checks = check;
+    }
+
+    int ret = 0;
+    while (ret == 0) {
+        struct reader_buffer* buffer = get_buffer(reader);
+        if (buffer == NULL) {
+            // a segment failed its check, stop feeding the extractor
+            ret = -1;
+            break;
+        }
+        ssize_t len = read(fd, buffer->data, READER_BUFFER_SIZE);
+        if (len < 0 && errno == EINTR) {
+            release_buffer(reader, buffer);
+            continue;
+        }
+        if (len <= 0) {
+            if (len < 0) {
+if ( language== 1 )
+                LOGE("Error reading %s (%s)\n", path, strerror(errno));
+else
+                LOGE("读取 %s 时出错 (%s)\n", path, strerror(errno));
+
+                ret = -1;
+            }
+            release_buffer(reader, buffer);
+            break;
+        }
+        buffer->len = len;
+        if (write_all(reader->fd, buffer->data, len) != 0)
+            ret = -1;
+
+        if (check == NULL) {
+            release_buffer(reader, buffer);
+            continue;
+        }
+        pthread_mutex_lock(&reader->lock);
+        buffer->next = NULL;
+        if (check->tail != NULL)
+            check->tail->next = buffer;
+        else
+            check->head = buffer;
+        check->tail = buffer;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    close(fd);
+
+    if (check != NULL) {
+        pthread_mutex_lock(&reader->lock);
+        check->eof = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return ret;
+}
+
+// Same order as "cat archive_file*": the (usually empty) archive file, then
+// the segments written by split or nandroid_tar_create().  The segments end
+// on record boundaries, so tar can't tell a missing one from the end of the
+// archive: any segment with a digest in nandroid.md5 has to be there.
+static void* reader_thread(void* cookie) {
+    nandroid_tar_reader* reader = (nandroid_tar_reader*)cookie;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char path[PATH_MAX];
+    struct stat st;
+    int last = 0;
+    int i;
+
+    int ret = stream_segment(reader, reader->archive_file);
+    for (i = 0; ret == 0 && i < 26; i++) {
+        snprintf(path, sizeof(path), "%s.%c", reader->archive_file, 'a' + i);
+        if (!last && stat(path, &st) == 0) {
+            ret = stream_segment(reader, path);
+            continue;
+        }
+        last = 1;
+        if (nandroid_md5_get(path, digest)) {
+if ( language== 1 )
+            LOGE("Missing %s\n", path);
+else
+            LOGE("缺少 %s\n", path);
+
+            ret = -1;
+        }
+    }
+
+    // EOF (or a truncated archive) for the extractor
+    close(reader->fd);
+    reader->fd = -1;
+    reader->error = ret;
+    return NULL;
+}
+
+nandroid_tar_reader* nandroid_tar_reader_start(const char* archive_file, int* fd) {
+    int pipefd[2];
+    int i;
+
+    nandroid_tar_reader* reader = calloc(1, sizeof(nandroid_tar_reader));
+    if (reader == NULL)
+        return NULL;
+    strncpy(reader->archive_file, archive_file, sizeof(reader->archive_file) - 1);
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    for (i = 0; i < READER_BUFFERS; i++) {
+        reader->buffers[i].data = malloc(READER_BUFFER_SIZE);
+        if (reader->buffers[i].data == NULL)
+            goto error;
+        reader->buffers[i].next = reader->free_list;
+        reader->free_list = &reader->buffers[i];
+    }
+
+    if (pipe(pipefd) != 0)
+        goto error;
+    // only the extractor should hold the read end
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    reader->fd = pipefd[1];
+    if (pthread_create(&reader->thread, NULL, reader_thread, reader) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        goto error;
+    }
+
+    *fd = pipefd[0];
+    return reader;
+
+error:
+    for (i = 0; i < READER_BUFFERS; i++)
+        free(reader->buffers[i].data);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->cond);
+    free(reader);
+    return NULL;
+}
+
+int nandroid_tar_reader_finish(nandroid_tar_reader* reader) {
+    int i;
+
+    pthread_join(reader->thread, NULL);
+    while (reader->checks != NULL) {
+        struct segment_check* next = reader->checks->next;
+        pthread_join(reader->checks->thread, NULL);
+        free(reader->checks);
+        reader->checks = next;
+    }
+
+    int ret = reader->mismatch ? -1 : reader->error;
+    for (i = 0; i < READER_BUFFERS; i++)
+        free(reader->buffers[i].data);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->cond);
+    free(reader);
+    return ret;
+}
@@ -0,0 +1,43 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+// Segment size of split backup archives (matches the old "split -b 1000000000")
+#define NANDROID_TAR_SEGMENT_SIZE 1000000000LL
+
+// nandroid_tar_create() flags
+#define NANDROID_TAR_GZIP 1
+
+typedef void (*nandroid_tar_callback)(const char* filename);
+
+// Archive source_dir (for example "/data") into a tar stream whose entries are
+// named relative to the parent of source_dir ("data/..."), like
+// "cd $(dirname source_dir) ; tar -c $(basename source_dir)".
+// The stream is written to output_file.a, output_file.b, ... in
+// NANDROID_TAR_SEGMENT_SIZE pieces, and an empty output_file is created so the
+// restore code can detect the backup format. The md5 of every file written
+// is recorded with nandroid_md5_add().
+// With NANDROID_TAR_GZIP, the stream is a single gzip member whose blocks are
+// deflated in parallel on one thread per online core.
+// excludes is a NULL terminated list of fnmatch() patterns matched against
+// entry names, it may be NULL.
+// callback is invoked with the name of each archived entry, it may be NULL.
+int nandroid_tar_create(const char* source_dir, const char* output_file,
+                        const char** excludes, int flags,
+                        nandroid_tar_callback callback);
+
+typedef struct nandroid_tar_reader nandroid_tar_reader;
+
+// Stream archive_file, archive_file.a, archive_file.b, ... in order (like
+// "cat archive_file*") from a background thread into a pipe whose read end is
+// returned in fd, for the extractor to read.
+// Every segment with a digest recorded in nandroid_md5 is hashed on a thread
+// of its own while the following data is read; the stream is cut short at the
+// first segment that does not match.
+// The caller must ignore SIGPIPE in case the extractor exits early.
+nandroid_tar_reader* nandroid_tar_reader_start(const char* archive_file, int* fd);
+
+// Wait for the stream and the segment checks to complete. Returns 0 if every
+// segment was read and matched its digest.
+int nandroid_tar_reader_finish(nandroid_tar_reader* reader);
+
+#endif
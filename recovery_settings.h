@@ -10,3 +10,5 @@
 // nandroid settings
 #define NANDROID_HIDE_PROGRESS_FILE  "clockworkmod/.hidenandroidprogress"
 #define NANDROID_BACKUP_FORMAT_FILE  "clockworkmod/.default_backup_format"
+#define NANDROID_DEDUPE_COMPRESS_FILE  "clockworkmod/.dedupe_compress"
+#define NANDROID_DEDUPE_BINARY_FILE  "clockworkmod/.dedupe_binary_manifest"
@@ -17,18 +17,20 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
@@ -410,7 +412,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_PARALLEL,
+                                      &timestamp,
                                       NULL, NULL, sehandle);
     free(zip_path);
     free(dest_path);
@@ -476,6 +479,11 @@ Value* PackageExtractFileFn(const char* name, State* state,
             goto done1;
         }
 
+        if (mzGetZipEntryUncompLen(entry) > SSIZE_MAX) {
+            fprintf(stderr, "%s: %s is too large to load (%lld bytes)\n",
+                    name, zip_path, mzGetZipEntryUncompLen(entry));
+            goto done1;
+        }
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -565,6 +573,43 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Walks the tree on a few threads, see ApplyMetadataRecursive() below.
+typedef int (*MetadataApplyFn)(const char* path, const struct stat* st, void* cookie);
+static int ApplyMetadataRecursive(const char* path, MetadataApplyFn apply, void* cookie);
+
+struct set_perm_args {
+    uid_t uid;
+    gid_t gid;
+    mode_t dir_mode;
+    mode_t file_mode;
+};
+
+// set_perm_recursive on one entry: the owner and the directory or file
+// mode, leaving alone whatever already matches.  chown() can clear the
+// set-id bits, so the mode is always set after one.
+static int ApplySetPerm(const char* path, const struct stat* st, void* cookie) {
+    const struct set_perm_args* args = (const struct set_perm_args*) cookie;
+
+    /* ignore symlinks */
+    if (S_ISLNK(st->st_mode)) {
+        return 0;
+    }
+
+    mode_t mode = S_ISDIR(st->st_mode) ? args->dir_mode : args->file_mode;
+    bool chowned = false;
+    if (st->st_uid != args->uid || st->st_gid != args->gid) {
+        if (chown(path, args->uid, args->gid) < 0) {
+            return 1;
+        }
+        chowned = true;
+    }
+    if ((chowned || (st->st_mode & 07777) != (mode & 07777)) &&
+        chmod(path, mode) < 0) {
+        return 1;
+    }
+    return 0;
+}
+
 Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
     bool recursive = (strcmp(name, "set_perm_recursive") == 0);
@@ -608,8 +653,9 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
+        struct set_perm_args perm_args = { uid, gid, dir_mode, file_mode };
         for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
+            ApplyMetadataRecursive(args[i], ApplySetPerm, &perm_args);
         }
     } else {
         int mode = strtoul(args[2], &end, 0);
@@ -771,7 +817,16 @@ static int ApplyParsedPerms(
         return 0;
     }
 
-    if (parsed.has_uid) {
+    /* Skip the calls that wouldn't change anything: on a tree that
+     * mostly has the right metadata already, those are most of them.
+     * chown() can clear the set-id bits, so after one the mode is no
+     * longer known until it has been set again.
+     */
+    mode_t cur_mode = statptr->st_mode & 07777;
+    bool mode_known = true;
+
+    if (parsed.has_uid && statptr->st_uid != parsed.uid) {
+        mode_known = false;
         if (chown(filename, parsed.uid, -1) < 0) {
             printf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
                    filename, parsed.uid, strerror(errno));
@@ -779,7 +834,8 @@ static int ApplyParsedPerms(
         }
     }
 
-    if (parsed.has_gid) {
+    if (parsed.has_gid && statptr->st_gid != parsed.gid) {
+        mode_known = false;
         if (chown(filename, -1, parsed.gid) < 0) {
             printf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
                    filename, parsed.gid, strerror(errno));
@@ -787,37 +843,53 @@ static int ApplyParsedPerms(
         }
     }
 
-    if (parsed.has_mode) {
+    if (parsed.has_mode &&
+        !(mode_known && cur_mode == (parsed.mode & 07777))) {
         if (chmod(filename, parsed.mode) < 0) {
             printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                    filename, parsed.mode, strerror(errno));
             bad++;
+        } else {
+            cur_mode = parsed.mode & 07777;
+            mode_known = true;
         }
     }
 
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
+    if (parsed.has_dmode && S_ISDIR(statptr->st_mode) &&
+        !(mode_known && cur_mode == (parsed.dmode & 07777))) {
         if (chmod(filename, parsed.dmode) < 0) {
             printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                    filename, parsed.dmode, strerror(errno));
             bad++;
+        } else {
+            cur_mode = parsed.dmode & 07777;
+            mode_known = true;
         }
     }
 
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
+    if (parsed.has_fmode && S_ISREG(statptr->st_mode) &&
+        !(mode_known && cur_mode == (parsed.fmode & 07777))) {
         if (chmod(filename, parsed.fmode) < 0) {
             printf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                    filename, parsed.fmode, strerror(errno));
             bad++;
+        } else {
+            cur_mode = parsed.fmode & 07777;
+            mode_known = true;
         }
     }
 
     if (parsed.has_selabel) {
+        char* cur_selabel = NULL;
         // TODO: Don't silently ignore ENOTSUP
-        if (lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
+        if ((lgetfilecon(filename, &cur_selabel) < 0 ||
+             strcmp(cur_selabel, parsed.selabel) != 0) &&
+            lsetfilecon(filename, parsed.selabel) && (errno != ENOTSUP)) {
             printf("ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
                    filename, parsed.selabel, strerror(errno));
             bad++;
         }
+        freecon(cur_selabel);
     }
 
     if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
@@ -840,7 +912,12 @@ static int ApplyParsedPerms(
             cap_data.data[0].inheritable = 0;
             cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
             cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
+            struct vfs_cap_data cur_cap_data;
+            if (getxattr(filename, XATTR_NAME_CAPS, &cur_cap_data,
+                         sizeof(cur_cap_data)) == sizeof(cap_data) &&
+                memcmp(&cur_cap_data, &cap_data, sizeof(cap_data)) == 0) {
+                // already set
+            } else if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0
 #ifdef RECOVERY_CANT_USE_CONFIG_EXT4_FS_XATTR
                  && (errno != EOPNOTSUPP)
 #endif
@@ -855,13 +932,237 @@ static int ApplyParsedPerms(
     return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
+// Recursive set_metadata and set_perm walk the tree on a few threads.
+// Directories are the unit of work: a worker lists one with getdents64,
+// applies the metadata of the files in it and queues its subdirectories.
+// A directory's own metadata is applied once everything below it is
+// done, so the order within each subtree is still that of nftw() with
+// FTW_DEPTH.
+#define METADATA_MAX_WORKERS 8
+#define METADATA_DIRENT_BUF_SIZE (32 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct metadata_dir {
+    char* path;
+    struct stat st;
+    struct metadata_dir* parent;
+    int pending;                    // its own listing, plus unfinished subdirectories
+    struct metadata_dir* next;      // in the queue
+};
+
+struct metadata_walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct metadata_dir* head;
+    struct metadata_dir* tail;
+    int busy;                       // workers listing a directory
+    int bad;
+    MetadataApplyFn apply;
+    void* cookie;
+};
+
+// Called with the lock held.
+static void QueueMetadataDir(struct metadata_walk* walk, struct metadata_dir* dir) {
+    dir->next = NULL;
+    if (walk->tail != NULL) {
+        walk->tail->next = dir;
+    } else {
+        walk->head = dir;
+    }
+    walk->tail = dir;
+    pthread_cond_signal(&walk->cond);
+}
+
+// Drop one reference to dir, applying its metadata once nothing is
+// left to do below it, and so on up the tree.
+static int FinishMetadataDir(struct metadata_walk* walk, struct metadata_dir* dir) {
+    int bad = 0;
+    while (dir != NULL) {
+        pthread_mutex_lock(&walk->lock);
+        int left = --dir->pending;
+        pthread_mutex_unlock(&walk->lock);
+        if (left > 0) {
+            break;
+        }
+        bad += walk->apply(dir->path, &dir->st, walk->cookie);
+        struct metadata_dir* parent = dir->parent;
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+    return bad;
+}
+
+static int ListMetadataDir(struct metadata_walk* walk, struct metadata_dir* dir,
+                           char* buf) {
+    int bad = 0;
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        printf("failed to open directory %s: %s\n", dir->path, strerror(errno));
+        return 1;
+    }
+
+    for (;;) {
+        int n = syscall(__NR_getdents64, fd, buf, METADATA_DIRENT_BUF_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                printf("failed to read directory %s: %s\n", dir->path, strerror(errno));
+                bad++;
+            }
+            break;
+        }
+
+        int pos;
+        for (pos = 0; pos < n; ) {
+            struct linux_dirent64* de = (struct linux_dirent64*) (buf + pos);
+            pos += de->d_reclen;
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            struct stat st;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                printf("failed to stat %s/%s: %s\n", dir->path, de->d_name, strerror(errno));
+                bad++;
+                continue;
+            }
+            char* path = malloc(strlen(dir->path) + strlen(de->d_name) + 2);
+            if (path == NULL) {
+                bad++;
+                continue;
+            }
+            sprintf(path, "%s/%s", dir->path, de->d_name);
+
+            if (!S_ISDIR(st.st_mode)) {
+                bad += walk->apply(path, &st, walk->cookie);
+                free(path);
+                continue;
+            }
+
+            struct metadata_dir* sub = malloc(sizeof(struct metadata_dir));
+            if (sub == NULL) {
+                free(path);
+                bad++;
+                continue;
+            }
+            sub->path = path;
+            sub->st = st;
+            sub->parent = dir;
+            sub->pending = 1;
+            pthread_mutex_lock(&walk->lock);
+            dir->pending++;
+            QueueMetadataDir(walk, sub);
+            pthread_mutex_unlock(&walk->lock);
+        }
+    }
+    close(fd);
+    return bad;
+}
+
+static void* MetadataWorker(void* cookie) {
+    struct metadata_walk* walk = (struct metadata_walk*) cookie;
+    char* buf = malloc(METADATA_DIRENT_BUF_SIZE);
+    int bad = 0;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+        while (walk->head == NULL && walk->busy > 0) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        struct metadata_dir* dir = walk->head;
+        if (dir == NULL) {
+            // nothing queued and nobody left to queue more
+            break;
+        }
+        walk->head = dir->next;
+        if (walk->head == NULL) {
+            walk->tail = NULL;
+        }
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (buf != NULL) {
+            bad += ListMetadataDir(walk, dir, buf);
+        } else {
+            bad++;
+        }
+        bad += FinishMetadataDir(walk, dir);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->busy == 0 && walk->head == NULL) {
+            pthread_cond_broadcast(&walk->cond);
+        }
+    }
+    walk->bad += bad;
+    pthread_mutex_unlock(&walk->lock);
+
+    free(buf);
+    return NULL;
+}
+
+// Apply "apply" to path and, if it is a directory, everything below it,
+// without following symlinks.  Returns the sum of what apply returned,
+// plus one for each entry that couldn't be reached.
+static int ApplyMetadataRecursive(const char* path, MetadataApplyFn apply, void* cookie) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        printf("failed to stat %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return apply(path, &st, cookie);
+    }
+
+    struct metadata_walk walk;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    walk.head = walk.tail = NULL;
+    walk.busy = 0;
+    walk.bad = 0;
+    walk.apply = apply;
+    walk.cookie = cookie;
+
+    struct metadata_dir* root = malloc(sizeof(struct metadata_dir));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        free(root);
+        return 1;
+    }
+    root->st = st;
+    root->parent = NULL;
+    root->pending = 1;
+    QueueMetadataDir(&walk, root);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1 ? 1 : cpus > METADATA_MAX_WORKERS ? METADATA_MAX_WORKERS : cpus;
+    pthread_t threads[METADATA_MAX_WORKERS];
+    int started = 0;
+    while (started < count - 1 &&
+           pthread_create(&threads[started], NULL, MetadataWorker, &walk) == 0) {
+        started++;
+    }
+    // this thread works too, so the walk completes even if none started
+    MetadataWorker(&walk);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+    return walk.bad;
+}
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(filename, statptr, recursive_parsed_args);
+static int ApplyParsedPermsFn(const char* path, const struct stat* st, void* cookie) {
+    return ApplyParsedPerms(path, st, *(struct perm_parsed_args*) cookie);
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -889,9 +1190,7 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
     struct perm_parsed_args parsed = ParsePermArgs(argc, args);
 
     if (recursive) {
-        recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
+        bad += ApplyMetadataRecursive(args[0], ApplyParsedPermsFn, &parsed);
     } else {
         bad += ApplyParsedPerms(args[0], &sb, parsed);
     }
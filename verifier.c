@@ -16,32 +16,81 @@
 
 #include "common.h"
 #include "verifier.h"
+#include "verifier_sha.h"
 
 #include "mincrypt/rsa.h"
-#include "mincrypt/sha.h"
-#include "mincrypt/sha256.h"
+
+#include <openssl/sha.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Hash the signed part of the package in HASH_CHUNK_SIZE pieces, asking
+// the kernel to read HASH_READAHEAD_SIZE ahead of the one being hashed.
+// The pages stay mapped (and cached) for the install that follows.
+#define HASH_CHUNK_SIZE (1024 * 1024)
+#define HASH_READAHEAD_SIZE (8 * 1024 * 1024)
+
+// The digests come from verifier_sha.c: the ARMv8 crypto extension or
+// SHA-NI where the CPU has it, else libcrypto's assembly in place of
+// mincrypt's portable C.
+struct hash_job {
+    const unsigned char* addr;
+    size_t length;
+    uint8_t digest[SHA_DIGEST_LENGTH];
+};
+
+// When keys of both types are loaded, SHA-1 runs on a thread of its own
+// over the same pages while the caller computes SHA-256, unless the
+// package is too small to be worth a thread.
+#define HASH_THREAD_MIN_SIZE (4 * HASH_CHUNK_SIZE)
+
+static void* sha1_thread(void* cookie) {
+    struct hash_job* job = (struct hash_job*)cookie;
+    struct verifier_sha_ctx ctx;
+    verifier_sha1_init(&ctx);
+    verifier_sha_update(&ctx, job->addr, job->length);
+    verifier_sha_final(&ctx, job->digest);
+    return NULL;
+}
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
+static void advise_willneed(const unsigned char* addr, size_t length,
+                            size_t offset, size_t size) {
+    if (offset >= length)
+        return;
+    if (size > length - offset)
+        size = length - offset;
+    // madvise() wants a page aligned start
+    uintptr_t start = (uintptr_t)(addr + offset) & ~((uintptr_t)getpagesize() - 1);
+    madvise((void*)start, (uintptr_t)(addr + offset + size) - start, MADV_WILLNEED);
+}
 
-int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
-    }
+// The footer and EOCD are within this many bytes of the end.
+#define TAIL_SIZE (0xffff + EOCD_HEADER_SIZE)
 
+// Check the signature footer and the EOCD record of a package "length"
+// bytes long, given its last "tail_len" bytes (TAIL_SIZE, or all of it if
+// it is shorter).  On success, points "eocd" into "tail" and fills in the
+// EOCD size and how much of the package the signature covers.
+//
+// The signed length is 64-bit: the EOCD here is always the classic one,
+// which a ZIP64 archive still ends with, but it can be anywhere in the
+// file.
+static int check_footer(const unsigned char* tail, size_t tail_len, uint64_t length,
+                        const unsigned char** eocd_out, size_t* eocd_size_out,
+                        uint64_t* signed_len_out) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -51,24 +100,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // us how far back from the end we have to start reading to find
     // the whole comment.
 
-#define FOOTER_SIZE 6
-
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (tail_len < FOOTER_SIZE) {
+        LOGE("package is too short for a footer\n");
         return VERIFY_FAILURE;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = tail + tail_len - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -80,19 +120,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
-#define EOCD_HEADER_SIZE 22
-
     // The end-of-central-directory record is 22 bytes plus any
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (tail_len < eocd_size) {
+        LOGE("package is too short for its EOCD\n");
         return VERIFY_FAILURE;
     }
 
@@ -100,26 +136,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    *signed_len_out = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* eocd = tail + tail_len - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -132,64 +157,37 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
+    *eocd_out = eocd;
+    *eocd_size_out = eocd_size;
+    return VERIFY_SUCCESS;
+}
 
-    bool need_sha1 = false;
-    bool need_sha256 = false;
+static void needed_hashes(const Certificate* pKeys, unsigned int numKeys,
+                          bool* need_sha1, bool* need_sha256) {
+    unsigned int i;
+    *need_sha1 = false;
+    *need_sha256 = false;
     for (i = 0; i < numKeys; ++i) {
         switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: need_sha1 = true; break;
-            case SHA256_DIGEST_SIZE: need_sha256 = true; break;
-        }
-    }
-
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-        unsigned int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
+            case SHA_DIGEST_LENGTH: *need_sha1 = true; break;
+            case SHA256_DIGEST_LENGTH: *need_sha256 = true; break;
         }
     }
-    fclose(f);
-    free(buffer);
-
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+}
 
+static int check_signature(const Certificate* pKeys, unsigned int numKeys,
+                           const unsigned char* eocd, size_t eocd_size,
+                           const uint8_t* sha1, const uint8_t* sha256) {
+    unsigned int i;
     for (i = 0; i < numKeys; ++i) {
         const uint8_t* hash;
         switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: hash = sha1; break;
-            case SHA256_DIGEST_SIZE: hash = sha256; break;
+            case SHA_DIGEST_LENGTH: hash = sha1; break;
+            case SHA256_DIGEST_LENGTH: hash = sha256; break;
             default: continue;
         }
 
@@ -198,17 +196,230 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         if (RSA_verify(pKeys[i].public_key, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, hash, pKeys[i].hash_len)) {
             LOGI("whole-file signature verified against key %d\n", i);
-            free(eocd);
             return VERIFY_SUCCESS;
         } else {
             LOGI("failed to verify against key %d\n", i);
         }
     }
-    free(eocd);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
 
+struct verify_stream {
+    const Certificate* pKeys;
+    unsigned int numKeys;
+    bool need_sha1;
+    bool need_sha256;
+    struct verifier_sha_ctx sha1_ctx;
+    struct verifier_sha_ctx sha256_ctx;
+    uint64_t hashed;            // bytes from the start of the file
+    unsigned char* buffer;
+};
+
+verify_stream* verify_stream_start(const Certificate* pKeys, unsigned int numKeys) {
+    verify_stream* vs = malloc(sizeof(verify_stream));
+    if (vs == NULL || (vs->buffer = malloc(HASH_CHUNK_SIZE)) == NULL) {
+        LOGE("failed to alloc memory for hash buffers\n");
+        free(vs);
+        return NULL;
+    }
+    vs->pKeys = pKeys;
+    vs->numKeys = numKeys;
+    needed_hashes(pKeys, numKeys, &vs->need_sha1, &vs->need_sha256);
+    LOGI("hashing with %s\n", verifier_sha_implementation());
+    verifier_sha1_init(&vs->sha1_ctx);
+    verifier_sha256_init(&vs->sha256_ctx);
+    vs->hashed = 0;
+    return vs;
+}
+
+// Hash the file from where the stream is up to "end".  Reports progress
+// towards "total" unless that is 0.
+static int stream_hash(verify_stream* vs, int fd, uint64_t end, uint64_t total) {
+    double frac = -1.0;
+    while (vs->hashed < end) {
+        size_t size = HASH_CHUNK_SIZE;
+        if (end - vs->hashed < size) size = end - vs->hashed;
+        ssize_t n = pread64(fd, vs->buffer, size, vs->hashed);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOGE("failed to read data from package (%s)\n",
+                 n < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        if (vs->need_sha1) verifier_sha_update(&vs->sha1_ctx, vs->buffer, n);
+        if (vs->need_sha256) verifier_sha_update(&vs->sha256_ctx, vs->buffer, n);
+        vs->hashed += n;
+        double f = vs->hashed / (double)total;
+        if (total > 0 && (f > frac + 0.02 || vs->hashed == end)) {
+            ui_set_progress(f);
+            frac = f;
+        }
+    }
+    return 0;
+}
+
+int verify_stream_read(verify_stream* vs, int fd, uint64_t available) {
+    if (available < vs->hashed) {
+        // the file was started over
+        verifier_sha1_init(&vs->sha1_ctx);
+        verifier_sha256_init(&vs->sha256_ctx);
+        vs->hashed = 0;
+    }
+    // Whatever the final length, everything but the last TAIL_SIZE bytes
+    // is covered by the signature.
+    if (available <= TAIL_SIZE)
+        return 0;
+    return stream_hash(vs, fd, available - TAIL_SIZE, 0);
+}
+
+void verify_stream_abort(verify_stream* vs) {
+    free(vs->buffer);
+    free(vs);
+}
+
+int verify_stream_finish(verify_stream* vs, int fd, uint64_t length) {
+    ui_set_progress(0.0);
+
+    size_t tail_len = length < TAIL_SIZE ? length : TAIL_SIZE;
+    unsigned char* tail = malloc(tail_len > 0 ? tail_len : 1);
+    int ret = VERIFY_FAILURE;
+    if (tail == NULL) {
+        LOGE("failed to alloc memory for hash buffers\n");
+        goto done;
+    }
+    if (pread64(fd, tail, tail_len, length - tail_len) != (ssize_t)tail_len) {
+        LOGE("failed to read the end of the package (%s)\n", strerror(errno));
+        goto done;
+    }
+
+    const unsigned char* eocd;
+    size_t eocd_size;
+    uint64_t signed_len;
+    if (check_footer(tail, tail_len, length, &eocd, &eocd_size, &signed_len) != VERIFY_SUCCESS)
+        goto done;
+    if (vs->hashed > signed_len) {
+        LOGE("package is shorter than the part already hashed\n");
+        goto done;
+    }
+    if (stream_hash(vs, fd, signed_len, signed_len) != 0)
+        goto done;
+
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+    verifier_sha_final(&vs->sha1_ctx, sha1);
+    verifier_sha_final(&vs->sha256_ctx, sha256);
+    ret = check_signature(vs->pKeys, vs->numKeys, eocd, eocd_size, sha1, sha256);
+
+done:
+    free(tail);
+    verify_stream_abort(vs);
+    return ret;
+}
+
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the path to the zip.  Verify it matches one of the given public
+// keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
+    int fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    off64_t length = lseek64(fd, 0, SEEK_END);
+    if (length < 0) {
+        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+
+    void* addr = MAP_FAILED;
+    if (length > 0 && (uint64_t)length <= SIZE_MAX)
+        addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        // For packages that can't be mapped whole, like those over 4GB
+        // on 32-bit builds
+        LOGI("can't map %s, reading it instead\n", path);
+        verify_stream* vs = verify_stream_start(pKeys, numKeys);
+        int ret = vs != NULL ? verify_stream_finish(vs, fd, length) : VERIFY_FAILURE;
+        close(fd);
+        return ret;
+    }
+    close(fd);
+
+    int ret = verify_mapped_file(addr, length, pKeys, numKeys);
+    munmap(addr, length);
+    return ret;
+}
+
+int verify_mapped_file(const unsigned char* addr, size_t length,
+                       const Certificate* pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
+
+    size_t tail_len = length < TAIL_SIZE ? length : TAIL_SIZE;
+    const unsigned char* eocd;
+    size_t eocd_size;
+    uint64_t signed_len;
+    if (check_footer(addr + length - tail_len, tail_len, length,
+                     &eocd, &eocd_size, &signed_len) != VERIFY_SUCCESS)
+        return VERIFY_FAILURE;
+
+    bool need_sha1, need_sha256;
+    needed_hashes(pKeys, numKeys, &need_sha1, &need_sha256);
+    LOGI("hashing with %s\n", verifier_sha_implementation());
+
+    madvise((void*)((uintptr_t)addr & ~((uintptr_t)getpagesize() - 1)),
+            length + ((uintptr_t)addr & (getpagesize() - 1)), MADV_SEQUENTIAL);
+    advise_willneed(addr, signed_len, 0, HASH_READAHEAD_SIZE);
+
+    struct hash_job sha1_job;
+    sha1_job.addr = addr;
+    sha1_job.length = signed_len;
+    pthread_t sha1_tid;
+    bool sha1_threaded = need_sha1 && need_sha256 &&
+            signed_len >= HASH_THREAD_MIN_SIZE &&
+            pthread_create(&sha1_tid, NULL, sha1_thread, &sha1_job) == 0;
+    bool sha1_inline = need_sha1 && !sha1_threaded;
+
+    struct verifier_sha_ctx sha1_ctx;
+    struct verifier_sha_ctx sha256_ctx;
+    verifier_sha1_init(&sha1_ctx);
+    verifier_sha256_init(&sha256_ctx);
+
+    double frac = -1.0;
+    size_t so_far = 0;
+    while (so_far < signed_len) {
+        size_t size = HASH_CHUNK_SIZE;
+        if (signed_len - so_far < size) size = signed_len - so_far;
+        // keep the readahead window HASH_READAHEAD_SIZE past this chunk
+        advise_willneed(addr, signed_len, so_far + HASH_READAHEAD_SIZE, size);
+        if (sha1_inline) verifier_sha_update(&sha1_ctx, addr + so_far, size);
+        if (need_sha256) verifier_sha_update(&sha256_ctx, addr + so_far, size);
+        so_far += size;
+        double f = so_far / (double)signed_len;
+        if (f > frac + 0.02 || size == so_far) {
+            ui_set_progress(f);
+            frac = f;
+        }
+    }
+
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+    verifier_sha_final(&sha256_ctx, sha256);
+    if (sha1_threaded)
+        pthread_join(sha1_tid, NULL);
+    else
+        verifier_sha_final(&sha1_ctx, sha1_job.digest);
+
+    return check_signature(pKeys, numKeys, eocd, eocd_size,
+                           sha1_job.digest, sha256);
+}
+
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
 // as a C source literal, eg:
@@ -263,22 +474,22 @@ load_keys(const char* filename, int* numKeys) {
             if (start_char == '{') {
                 // a version 1 key has no version specifier.
                 cert->public_key->exponent = 3;
-                cert->hash_len = SHA_DIGEST_SIZE;
+                cert->hash_len = SHA_DIGEST_LENGTH;
             } else if (start_char == 'v') {
                 int version;
                 if (fscanf(f, "%d {", &version) != 1) goto exit;
                 switch (version) {
                     case 2:
                         cert->public_key->exponent = 65537;
-                        cert->hash_len = SHA_DIGEST_SIZE;
+                        cert->hash_len = SHA_DIGEST_LENGTH;
                         break;
                     case 3:
                         cert->public_key->exponent = 3;
-                        cert->hash_len = SHA256_DIGEST_SIZE;
+                        cert->hash_len = SHA256_DIGEST_LENGTH;
                         break;
                     case 4:
                         cert->public_key->exponent = 65537;
-                        cert->hash_len = SHA256_DIGEST_SIZE;
+                        cert->hash_len = SHA256_DIGEST_LENGTH;
                         break;
                     default:
                         goto exit;
@@ -17,6 +17,9 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "mincrypt/rsa.h"
 
 typedef struct Certificate {
@@ -29,6 +32,29 @@ typedef struct Certificate {
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), on a package that is already mapped in memory.
+ * The mapping is read sequentially with readahead, so its pages are
+ * cached for whatever reads the package next.
+ */
+int verify_mapped_file(const unsigned char* addr, size_t length,
+                       const Certificate *pKeys, unsigned int numKeys);
+
+/* Verify a package while it is still being written, for sideloading.
+ * verify_stream_read() hashes what it can of the first "available" bytes
+ * of the file in "fd"; call it as the file grows.  Once the file is
+ * complete, verify_stream_finish() hashes the rest, checks the signature
+ * against the keys passed to verify_stream_start() (which must stay
+ * around until then) and frees the stream; verify_stream_abort() frees it
+ * without checking anything.  A stream that sees the file shrink starts
+ * over.
+ */
+typedef struct verify_stream verify_stream;
+
+verify_stream* verify_stream_start(const Certificate *pKeys, unsigned int numKeys);
+int verify_stream_read(verify_stream* vs, int fd, uint64_t available);
+int verify_stream_finish(verify_stream* vs, int fd, uint64_t length);
+void verify_stream_abort(verify_stream* vs);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
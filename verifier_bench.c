@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "verifier.h"
+#include "verifier_sha.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+
+// Package hashing throughput: the portable mincrypt loop verify_file()
+// used to run, against verify_mapped_file() with SHA-1 keys, SHA-256 keys
+// and both.  verify_mapped_file() runs with the block functions
+// verifier_sha.c picked for this CPU, then again with libcrypto if those
+// were the ARMv8 crypto extension or SHA-NI.  The keys are never valid,
+// so only the hashing is timed.
+//
+//   verifier_bench [-n <MB>] bootable/recovery/testdata/*.zip
+
+#define DEFAULT_VOLUME_MB 256
+#define PORTABLE_BLOCK_SIZE 4096
+
+// verify_mapped_file() reports on every run, through ui_print() and
+// LOGI() on stdout, so results go to a copy of stdout taken first
+static FILE* out;
+
+void ui_print(const char* fmt, ...) {
+}
+
+void ui_set_progress(float fraction) {
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void portable_hash(const unsigned char* addr, size_t length) {
+    SHA_CTX sha1_ctx;
+    SHA256_CTX sha256_ctx;
+    SHA_init(&sha1_ctx);
+    SHA256_init(&sha256_ctx);
+    size_t so_far;
+    for (so_far = 0; so_far < length; so_far += PORTABLE_BLOCK_SIZE) {
+        int size = length - so_far < PORTABLE_BLOCK_SIZE ? length - so_far : PORTABLE_BLOCK_SIZE;
+        SHA_update(&sha1_ctx, addr + so_far, size);
+        SHA256_update(&sha256_ctx, addr + so_far, size);
+    }
+    SHA_final(&sha1_ctx);
+    SHA256_final(&sha256_ctx);
+}
+
+static void report(const char* what, size_t length, int runs, double seconds) {
+    fprintf(out, "  %-20s %8.1f MB/s\n", what,
+           seconds > 0 ? length * (double)runs / seconds / (1024 * 1024) : 0.0);
+}
+
+static void bench(const char* path, size_t volume) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "can't open %s (%s)\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    unsigned char* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "can't map %s (%s)\n", path, strerror(errno));
+        return;
+    }
+
+    size_t length = st.st_size;
+    if (length < 6 || addr[length - 4] != 0xff || addr[length - 3] != 0xff) {
+        // verify_mapped_file() would reject it before hashing anything
+        fprintf(out, "%s: no whole-file signature footer, skipped\n", path);
+        munmap(addr, length);
+        return;
+    }
+    int runs = volume / length;
+    if (runs < 1) runs = 1;
+    fprintf(out, "%s: %zu bytes x %d\n", path, length, runs);
+
+    int i;
+    double start = now();
+    for (i = 0; i < runs; i++)
+        portable_hash(addr, length);
+    report("portable both", length, runs, now() - start);
+
+    RSAPublicKey key;
+    memset(&key, 0, sizeof(key));   // len 0, so RSA_verify() fails at once
+    Certificate certs[2] = {
+        { SHA_DIGEST_SIZE, &key },
+        { SHA256_DIGEST_SIZE, &key },
+    };
+    const char* last_impl = "";
+    static const struct {
+        const char* name;
+        int first;
+        int count;
+    } modes[] = {
+        { "sha1", 0, 1 },
+        { "sha256", 1, 1 },
+        { "both", 0, 2 },
+    };
+    int use_hw;
+    for (use_hw = 1; use_hw >= 0; use_hw--) {
+        verifier_sha_use_hw(use_hw);
+        const char* impl = verifier_sha_implementation();
+        if (!use_hw && strcmp(impl, last_impl) == 0)
+            break;
+        last_impl = impl;
+        unsigned int m;
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            char what[64];
+            snprintf(what, sizeof(what), "%s %s", impl, modes[m].name);
+            start = now();
+            for (i = 0; i < runs; i++)
+                verify_mapped_file(addr, length, certs + modes[m].first, modes[m].count);
+            report(what, length, runs, now() - start);
+        }
+    }
+    verifier_sha_use_hw(1);
+
+    munmap(addr, length);
+}
+
+int main(int argc, char** argv) {
+    size_t volume = DEFAULT_VOLUME_MB * 1024 * 1024;
+    int i = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        volume = (size_t)atoi(argv[2]) * 1024 * 1024;
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "Usage: %s [-n <MB>] <package>...\n", argv[0]);
+        return 2;
+    }
+
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "can't redirect stdout (%s)\n", strerror(errno));
+        return 1;
+    }
+    for (; i < argc; i++)
+        bench(argv[i], volume);
+    fclose(out);
+    return 0;
+}
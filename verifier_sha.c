@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__arm__) || defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "verifier_sha.h"
+
+#if defined(__aarch64__)
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#elif defined(__arm__)
+// 32-bit ARMv8 reports them in AT_HWCAP2
+#ifndef AT_HWCAP2
+#define AT_HWCAP2 26
+#endif
+#ifndef HWCAP2_SHA1
+#define HWCAP2_SHA1 (1 << 2)
+#endif
+#ifndef HWCAP2_SHA2
+#define HWCAP2_SHA2 (1 << 3)
+#endif
+#endif
+
+static pthread_once_t hw_once = PTHREAD_ONCE_INIT;
+static int hw_available;
+static int hw_disabled;
+
+// Only what was both built and is supported by this CPU.  This runs with
+// the normal compiler flags, so an ARMv7 or pre-SHA x86 CPU never gets to
+// the code in verifier_sha_hw.c.
+static void detect_hw() {
+    int cpu = 0;
+#if defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    if (hwcap & HWCAP_SHA1) cpu |= VERIFIER_SHA_HW_SHA1;
+    if (hwcap & HWCAP_SHA2) cpu |= VERIFIER_SHA_HW_SHA256;
+#elif defined(__arm__)
+    unsigned long hwcap2 = getauxval(AT_HWCAP2);
+    if (hwcap2 & HWCAP2_SHA1) cpu |= VERIFIER_SHA_HW_SHA1;
+    if (hwcap2 & HWCAP2_SHA2) cpu |= VERIFIER_SHA_HW_SHA256;
+#elif defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    // SHA-NI, plus the SSSE3 and SSE4.1 the block functions also use
+    if (__get_cpuid_max(0, NULL) >= 7 &&
+            __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            (ecx & (1 << 9)) && (ecx & (1 << 19))) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ebx & (1 << 29))
+            cpu = VERIFIER_SHA_HW_SHA1 | VERIFIER_SHA_HW_SHA256;
+    }
+#endif
+    hw_available = cpu & verifier_sha_hw_built;
+}
+
+static int hw(int which) {
+    pthread_once(&hw_once, detect_hw);
+    return !hw_disabled && (hw_available & which);
+}
+
+const char* verifier_sha_implementation() {
+    if (!hw(VERIFIER_SHA_HW_SHA1 | VERIFIER_SHA_HW_SHA256))
+        return "libcrypto";
+#if defined(__arm__) || defined(__aarch64__)
+    return "armv8-ce";
+#else
+    return "sha-ni";
+#endif
+}
+
+void verifier_sha_use_hw(int use) {
+    hw_disabled = !use;
+}
+
+void verifier_sha1_init(struct verifier_sha_ctx* ctx) {
+    static const uint32_t initial[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+    };
+    ctx->digest_len = SHA_DIGEST_LENGTH;
+    ctx->block = hw(VERIFIER_SHA_HW_SHA1) ? verifier_sha1_block_hw : NULL;
+    if (ctx->block == NULL) {
+        SHA1_Init(&ctx->sw.sha1);
+        return;
+    }
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void verifier_sha256_init(struct verifier_sha_ctx* ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    ctx->digest_len = SHA256_DIGEST_LENGTH;
+    ctx->block = hw(VERIFIER_SHA_HW_SHA256) ? verifier_sha256_block_hw : NULL;
+    if (ctx->block == NULL) {
+        SHA256_Init(&ctx->sw.sha256);
+        return;
+    }
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void verifier_sha_update(struct verifier_sha_ctx* ctx, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (ctx->block == NULL) {
+        if (ctx->digest_len == SHA_DIGEST_LENGTH)
+            SHA1_Update(&ctx->sw.sha1, p, len);
+        else
+            SHA256_Update(&ctx->sw.sha256, p, len);
+        return;
+    }
+
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t n = sizeof(ctx->buffer) - ctx->used;
+        if (n > len) n = len;
+        memcpy(ctx->buffer + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used < sizeof(ctx->buffer))
+            return;
+        ctx->block(ctx->state, ctx->buffer, 1);
+        ctx->used = 0;
+    }
+    if (len >= sizeof(ctx->buffer)) {
+        size_t blocks = len / sizeof(ctx->buffer);
+        ctx->block(ctx->state, p, blocks);
+        p += blocks * sizeof(ctx->buffer);
+        len -= blocks * sizeof(ctx->buffer);
+    }
+    memcpy(ctx->buffer, p, len);
+    ctx->used = len;
+}
+
+void verifier_sha_final(struct verifier_sha_ctx* ctx, uint8_t* digest) {
+    if (ctx->block == NULL) {
+        if (ctx->digest_len == SHA_DIGEST_LENGTH)
+            SHA1_Final(digest, &ctx->sw.sha1);
+        else
+            SHA256_Final(digest, &ctx->sw.sha256);
+        return;
+    }
+
+    // both pad with 0x80, zeros and the big-endian length in bits
+    uint64_t bits = ctx->length * 8;
+    ctx->buffer[ctx->used++] = 0x80;
+    if (ctx->used > sizeof(ctx->buffer) - 8) {
+        memset(ctx->buffer + ctx->used, 0, sizeof(ctx->buffer) - ctx->used);
+        ctx->block(ctx->state, ctx->buffer, 1);
+        ctx->used = 0;
+    }
+    memset(ctx->buffer + ctx->used, 0, sizeof(ctx->buffer) - 8 - ctx->used);
+    int i;
+    for (i = 0; i < 8; i++)
+        ctx->buffer[sizeof(ctx->buffer) - 1 - i] = bits >> (8 * i);
+    ctx->block(ctx->state, ctx->buffer, 1);
+
+    for (i = 0; i < (int)ctx->digest_len / 4; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef VERIFIER_SHA_H
+#define VERIFIER_SHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/sha.h>
+
+// SHA-1 and SHA-256 for package verification.  The block functions are
+// picked once, at runtime: the ARMv8 crypto extension (HWCAP_SHA1 and
+// HWCAP_SHA2) or x86 SHA-NI (CPUID leaf 7, EBX bit 29) when the CPU has
+// them and the toolchain could build them, libcrypto otherwise.
+
+struct verifier_sha_ctx {
+    // NULL when libcrypto does the hashing
+    void (*block)(uint32_t* state, const uint8_t* data, size_t blocks);
+    size_t digest_len;
+    union {
+        SHA_CTX sha1;
+        SHA256_CTX sha256;
+    } sw;
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t used;
+};
+
+void verifier_sha1_init(struct verifier_sha_ctx* ctx);
+void verifier_sha256_init(struct verifier_sha_ctx* ctx);
+void verifier_sha_update(struct verifier_sha_ctx* ctx, const void* data, size_t len);
+// Writes digest_len bytes.
+void verifier_sha_final(struct verifier_sha_ctx* ctx, uint8_t* digest);
+
+// "armv8-ce", "sha-ni" or "libcrypto", for the log and verifier_bench.
+const char* verifier_sha_implementation();
+
+// Whether contexts initialized from now on may use the hardware block
+// functions (the default), for verifier_bench to time libcrypto too.
+void verifier_sha_use_hw(int use);
+
+// Built in verifier_sha_hw.c with the compiler flags for the instructions.
+// Only call them once the CPU has been checked.
+#define VERIFIER_SHA_HW_SHA1 1
+#define VERIFIER_SHA_HW_SHA256 2
+extern const int verifier_sha_hw_built;
+void verifier_sha1_block_hw(uint32_t* state, const uint8_t* data, size_t blocks);
+void verifier_sha256_block_hw(uint32_t* state, const uint8_t* data, size_t blocks);
+
+#endif
@@ -0,0 +1,261 @@
+#include "verifier_sha.h"
+
+// Built with -march=armv8-a+crypto (or -mfpu=crypto-neon-fp-armv8) on ARM
+// and -msse4.1 -msha on x86, see Android.mk.  Without those this file only
+// says nothing was built, and verifier_sha.c sticks to libcrypto.
+
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)
+#define SHA_HW_ARM 1
+#include <arm_neon.h>
+#elif defined(__SHA__) && defined(__SSE4_1__)
+#define SHA_HW_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(SHA_HW_ARM) || defined(SHA_HW_X86)
+
+const int verifier_sha_hw_built = VERIFIER_SHA_HW_SHA1 | VERIFIER_SHA_HW_SHA256;
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#endif
+
+// The rounds are unrolled four at a time, with w0..w3 holding the last four
+// message vectors; SCHEDULE replaces w0 with the next one.
+
+#if defined(SHA_HW_ARM)
+
+static uint32x4_t load_be(const uint8_t* p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+#define SHA1_K0 0x5a827999
+#define SHA1_K1 0x6ed9eba1
+#define SHA1_K2 0x8f1bbcdc
+#define SHA1_K3 0xca62c1d6
+
+#define SHA1_SCHEDULE(w0, w1, w2, w3) \
+    w0 = vsha1su1q_u32(vsha1su0q_u32(w0, w1, w2), w3)
+#define SHA1_ROUNDS(op, w, k) \
+    wk = vaddq_u32(w, vdupq_n_u32(k)); \
+    e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+    abcd = op(abcd, e, wk); \
+    e = e_next
+
+void verifier_sha1_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_saved = abcd;
+        uint32_t e_saved = e;
+        uint32x4_t w0 = load_be(data);
+        uint32x4_t w1 = load_be(data + 16);
+        uint32x4_t w2 = load_be(data + 32);
+        uint32x4_t w3 = load_be(data + 48);
+        uint32x4_t wk;
+        uint32_t e_next;
+
+        SHA1_ROUNDS(vsha1cq_u32, w0, SHA1_K0);
+        SHA1_ROUNDS(vsha1cq_u32, w1, SHA1_K0);
+        SHA1_ROUNDS(vsha1cq_u32, w2, SHA1_K0);
+        SHA1_ROUNDS(vsha1cq_u32, w3, SHA1_K0);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(vsha1cq_u32, w0, SHA1_K0);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(vsha1pq_u32, w1, SHA1_K1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(vsha1pq_u32, w2, SHA1_K1);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(vsha1pq_u32, w3, SHA1_K1);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(vsha1pq_u32, w0, SHA1_K1);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(vsha1pq_u32, w1, SHA1_K1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(vsha1mq_u32, w2, SHA1_K2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(vsha1mq_u32, w3, SHA1_K2);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(vsha1mq_u32, w0, SHA1_K2);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(vsha1mq_u32, w1, SHA1_K2);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(vsha1mq_u32, w2, SHA1_K2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(vsha1pq_u32, w3, SHA1_K3);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(vsha1pq_u32, w0, SHA1_K3);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(vsha1pq_u32, w1, SHA1_K3);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(vsha1pq_u32, w2, SHA1_K3);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(vsha1pq_u32, w3, SHA1_K3);
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        e += e_saved;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+#define SHA256_SCHEDULE(w0, w1, w2, w3) \
+    w0 = vsha256su1q_u32(vsha256su0q_u32(w0, w1), w2, w3)
+#define SHA256_ROUNDS(w, i) \
+    wk = vaddq_u32(w, vld1q_u32(sha256_k + 4 * (i))); \
+    abcd_prev = abcd; \
+    abcd = vsha256hq_u32(abcd, efgh, wk); \
+    efgh = vsha256h2q_u32(efgh, abcd_prev, wk)
+
+void verifier_sha256_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32x4_t efgh = vld1q_u32(state + 4);
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_saved = abcd;
+        uint32x4_t efgh_saved = efgh;
+        uint32x4_t w0 = load_be(data);
+        uint32x4_t w1 = load_be(data + 16);
+        uint32x4_t w2 = load_be(data + 32);
+        uint32x4_t w3 = load_be(data + 48);
+        uint32x4_t wk, abcd_prev;
+        int i;
+
+        SHA256_ROUNDS(w0, 0);
+        SHA256_ROUNDS(w1, 1);
+        SHA256_ROUNDS(w2, 2);
+        SHA256_ROUNDS(w3, 3);
+        for (i = 4; i < 16; i += 4) {
+            SHA256_SCHEDULE(w0, w1, w2, w3); SHA256_ROUNDS(w0, i);
+            SHA256_SCHEDULE(w1, w2, w3, w0); SHA256_ROUNDS(w1, i + 1);
+            SHA256_SCHEDULE(w2, w3, w0, w1); SHA256_ROUNDS(w2, i + 2);
+            SHA256_SCHEDULE(w3, w0, w1, w2); SHA256_ROUNDS(w3, i + 3);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        efgh = vaddq_u32(efgh, efgh_saved);
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    vst1q_u32(state + 4, efgh);
+}
+
+#elif defined(SHA_HW_X86)
+
+static __m128i load_be(const uint8_t* p, __m128i bswap) {
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), bswap);
+}
+
+// SHA-NI keeps E in the top lane of a register of its own, A..D reversed
+// in another.  e0 and e1 take turns: one has E for the next four rounds,
+// the other gets A before them, which sha1nexte turns into the E after.
+#define SHA1_SCHEDULE(w0, w1, w2, w3) \
+    w0 = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w0, w1), w2), w3)
+#define SHA1_ROUNDS(f, e0, e1, w) \
+    e0 = _mm_sha1nexte_epu32(e0, w); \
+    e1 = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, f)
+
+void verifier_sha1_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks-- > 0) {
+        __m128i abcd_saved = abcd;
+        __m128i e_saved = e0;
+        __m128i w0 = load_be(data, bswap);
+        __m128i w1 = load_be(data + 16, bswap);
+        __m128i w2 = load_be(data + 32, bswap);
+        __m128i w3 = load_be(data + 48, bswap);
+        __m128i e1;
+
+        e0 = _mm_add_epi32(e0, w0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        SHA1_ROUNDS(0, e1, e0, w1);
+        SHA1_ROUNDS(0, e0, e1, w2);
+        SHA1_ROUNDS(0, e1, e0, w3);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(0, e0, e1, w0);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(1, e1, e0, w1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(1, e0, e1, w2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(1, e1, e0, w3);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(1, e0, e1, w0);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(1, e1, e0, w1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(2, e0, e1, w2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(2, e1, e0, w3);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(2, e0, e1, w0);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(2, e1, e0, w1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(2, e0, e1, w2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(3, e1, e0, w3);
+        SHA1_SCHEDULE(w0, w1, w2, w3); SHA1_ROUNDS(3, e0, e1, w0);
+        SHA1_SCHEDULE(w1, w2, w3, w0); SHA1_ROUNDS(3, e1, e0, w1);
+        SHA1_SCHEDULE(w2, w3, w0, w1); SHA1_ROUNDS(3, e0, e1, w2);
+        SHA1_SCHEDULE(w3, w0, w1, w2); SHA1_ROUNDS(3, e1, e0, w3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define SHA256_SCHEDULE(w0, w1, w2, w3) \
+    w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), \
+                                            _mm_alignr_epi8(w3, w2, 4)), w3)
+#define SHA256_ROUNDS(w, i) \
+    wk = _mm_add_epi32(w, _mm_load_si128((const __m128i*)(sha256_k + 4 * (i)))); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk); \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e))
+
+// SHA-NI wants the state as ABEF and CDGH.
+void verifier_sha256_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);
+    __m128i abef = _mm_alignr_epi8(dcba, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, dcba, 0xf0);
+
+    while (blocks-- > 0) {
+        __m128i abef_saved = abef;
+        __m128i cdgh_saved = cdgh;
+        __m128i w0 = load_be(data, bswap);
+        __m128i w1 = load_be(data + 16, bswap);
+        __m128i w2 = load_be(data + 32, bswap);
+        __m128i w3 = load_be(data + 48, bswap);
+        __m128i wk;
+        int i;
+
+        SHA256_ROUNDS(w0, 0);
+        SHA256_ROUNDS(w1, 1);
+        SHA256_ROUNDS(w2, 2);
+        SHA256_ROUNDS(w3, 3);
+        for (i = 4; i < 16; i += 4) {
+            SHA256_SCHEDULE(w0, w1, w2, w3); SHA256_ROUNDS(w0, i);
+            SHA256_SCHEDULE(w1, w2, w3, w0); SHA256_ROUNDS(w1, i + 1);
+            SHA256_SCHEDULE(w2, w3, w0, w1); SHA256_ROUNDS(w2, i + 2);
+            SHA256_SCHEDULE(w3, w0, w1, w2); SHA256_ROUNDS(w3, i + 3);
+        }
+
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+        data += 64;
+    }
+
+    // back to ABCD and EFGH
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#else
+
+const int verifier_sha_hw_built = 0;
+
+void verifier_sha1_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+}
+
+void verifier_sha256_block_hw(uint32_t* state, const uint8_t* data, size_t blocks) {
+}
+
+#endif